@@ -0,0 +1,70 @@
+#include "ChunkBuffer.h"
+
+#include <algorithm>
+
+const size_t CHUNK_SIZE = 64 * 1024;
+
+namespace {
+
+const char* BASE64_CHARACTERS =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+void encode_group(const unsigned char* in, size_t length, std::string& out) {
+  uint32_t v = in[0] << 16;
+  if (length > 1) v |= in[1] << 8;
+  if (length > 2) v |= in[2];
+  out += BASE64_CHARACTERS[(v >> 18) & 63];
+  out += BASE64_CHARACTERS[(v >> 12) & 63];
+  out += length > 1 ? BASE64_CHARACTERS[(v >> 6) & 63] : '=';
+  out += length > 2 ? BASE64_CHARACTERS[v & 63] : '=';
+}
+
+}  // namespace
+
+ChunkBuffer::ChunkBuffer(std::string&& data) { append(std::move(data)); }
+
+void ChunkBuffer::append(const char* data, size_t length) {
+  if (length == 0) return;
+  if (chunks_.empty() ||
+      chunks_.back().size() + length > chunks_.back().capacity()) {
+    chunks_.emplace_back();
+    chunks_.back().reserve(std::max(CHUNK_SIZE, length));
+  }
+  chunks_.back().append(data, length);
+  size_ += length;
+}
+
+void ChunkBuffer::append(std::string&& data) {
+  if (data.empty()) return;
+  size_ += data.size();
+  chunks_.push_back(std::move(data));
+}
+
+std::string ChunkBuffer::to_string() const {
+  std::string result;
+  result.reserve(size_);
+  for_each(
+      [&](const char* data, size_t length) { result.append(data, length); });
+  return result;
+}
+
+std::string to_base64(const ChunkBuffer& buffer) {
+  std::string result;
+  result.reserve((buffer.size() + 2) / 3 * 4);
+  unsigned char pending[3];
+  size_t pending_size = 0;
+  buffer.for_each([&](const char* data, size_t length) {
+    auto input = reinterpret_cast<const unsigned char*>(data);
+    size_t i = 0;
+    while (pending_size > 0 && pending_size < 3 && i < length)
+      pending[pending_size++] = input[i++];
+    if (pending_size == 3) {
+      encode_group(pending, 3, result);
+      pending_size = 0;
+    }
+    for (; i + 3 <= length; i += 3) encode_group(input + i, 3, result);
+    for (; i < length; i++) pending[pending_size++] = input[i];
+  });
+  if (pending_size > 0) encode_group(pending, pending_size, result);
+  return result;
+}
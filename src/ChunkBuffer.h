@@ -0,0 +1,34 @@
+#ifndef CHUNK_BUFFER_H
+#define CHUNK_BUFFER_H
+
+#include <deque>
+#include <string>
+
+// Holds thumbnail bytes as a list of chunks, so that a download grows without
+// moving what it already received and whole strings are adopted as they are.
+class ChunkBuffer {
+ public:
+  ChunkBuffer() = default;
+  ChunkBuffer(std::string&&);
+
+  void append(const char* data, size_t length);
+  void append(std::string&&);
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  std::string to_string() const;
+
+  template <class Function>
+  void for_each(Function f) const {
+    for (const auto& c : chunks_) f(c.data(), c.size());
+  }
+
+ private:
+  std::deque<std::string> chunks_;
+  size_t size_ = 0;
+};
+
+std::string to_base64(const ChunkBuffer&);
+
+#endif  // CHUNK_BUFFER_H
@@ -0,0 +1,98 @@
+#include "Compression.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+const size_t COMPRESSION_BUFFER_SIZE = 16384;
+
+namespace {
+
+std::string trim(const std::string& str) {
+  auto begin = str.find_first_not_of(" \t");
+  if (begin == std::string::npos) return "";
+  auto end = str.find_last_not_of(" \t");
+  return str.substr(begin, end - begin + 1);
+}
+
+}  // namespace
+
+Encoding negotiate_encoding(const char* accept_encoding) {
+  if (!accept_encoding) return Encoding::Identity;
+  double gzip = 0, deflate = 0, any = 0;
+  bool gzip_listed = false, deflate_listed = false;
+  std::string header = accept_encoding;
+  size_t position = 0;
+  while (position <= header.size()) {
+    auto end = header.find(',', position);
+    if (end == std::string::npos) end = header.size();
+    auto token = header.substr(position, end - position);
+    position = end + 1;
+    double q = 1;
+    auto separator = token.find(';');
+    if (separator != std::string::npos) {
+      auto parameter = trim(token.substr(separator + 1));
+      if (parameter.compare(0, 2, "q=") == 0)
+        q = std::strtod(parameter.c_str() + 2, nullptr);
+      token = token.substr(0, separator);
+    }
+    token = trim(token);
+    std::transform(token.begin(), token.end(), token.begin(), ::tolower);
+    if (token == "gzip" || token == "x-gzip") {
+      gzip = q;
+      gzip_listed = true;
+    } else if (token == "deflate") {
+      deflate = q;
+      deflate_listed = true;
+    } else if (token == "*") {
+      any = q;
+    }
+  }
+  // "*" only covers codings not listed, q=0 refuses a listed one.
+  if (!gzip_listed) gzip = any;
+  if (!deflate_listed) deflate = any;
+  if (gzip > 0 && gzip >= deflate) return Encoding::Gzip;
+  if (deflate > 0) return Encoding::Deflate;
+  return Encoding::Identity;
+}
+
+const char* encoding_name(Encoding encoding) {
+  switch (encoding) {
+    case Encoding::Gzip:
+      return "gzip";
+    case Encoding::Deflate:
+      return "deflate";
+    default:
+      return "identity";
+  }
+}
+
+Compressor::Compressor(Encoding encoding, int level) {
+  memset(&stream_, 0, sizeof(stream_));
+  int window_bits = encoding == Encoding::Gzip ? 15 + 16 : 15;
+  if (deflateInit2(&stream_, level, Z_DEFLATED, window_bits, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    throw std::logic_error("deflateInit2 failed");
+}
+
+Compressor::~Compressor() { deflateEnd(&stream_); }
+
+std::string Compressor::write(const char* data, size_t size, int flush) {
+  std::string output;
+  char buffer[COMPRESSION_BUFFER_SIZE];
+  stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+  stream_.avail_in = size;
+  do {
+    stream_.next_out = reinterpret_cast<Bytef*>(buffer);
+    stream_.avail_out = sizeof(buffer);
+    deflate(&stream_, flush);
+    output.append(buffer, sizeof(buffer) - stream_.avail_out);
+  } while (stream_.avail_out == 0);
+  return output;
+}
+
+std::string compress(Encoding encoding, int level, const std::string& data) {
+  return Compressor(encoding, level).write(data.data(), data.size(), Z_FINISH);
+}
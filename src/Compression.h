@@ -0,0 +1,25 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <zlib.h>
+#include <string>
+
+enum class Encoding { Identity, Gzip, Deflate };
+
+Encoding negotiate_encoding(const char* accept_encoding);
+const char* encoding_name(Encoding);
+
+class Compressor {
+ public:
+  Compressor(Encoding, int level);
+  ~Compressor();
+
+  std::string write(const char* data, size_t size, int flush = Z_NO_FLUSH);
+
+ private:
+  z_stream stream_;
+};
+
+std::string compress(Encoding, int level, const std::string&);
+
+#endif  // COMPRESSION_H
@@ -0,0 +1,346 @@
+#include "CurlMultiHttp.h"
+
+#include <curl/curl.h>
+#include <algorithm>
+#include <cctype>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using cloudstorage::EitherError;
+using cloudstorage::Error;
+
+const long POLL_TIMEOUT_MS = 1000;
+// How often paused transfers check whether their reader caught up.
+const long PAUSE_POLL_MS = 20;
+const long CONNECT_TIMEOUT = 30;
+// Transfers getting less than LOW_SPEED_LIMIT bytes per second for
+// LOW_SPEED_TIME seconds are considered stalled and fail.
+const long LOW_SPEED_LIMIT = 1;
+const long LOW_SPEED_TIME = 60;
+
+namespace {
+
+struct Transfer {
+  ~Transfer() {
+    curl_slist_free_all(headers_);
+    curl_easy_cleanup(handle_);
+  }
+
+  CURL* handle_ = nullptr;
+  curl_slist* headers_ = nullptr;
+  IHttpRequest::CompleteCallback complete_;
+  std::shared_ptr<std::istream> data_;
+  std::shared_ptr<std::ostream> response_;
+  std::shared_ptr<std::ostream> error_stream_;
+  IHttpRequest::ICallback::Pointer callback_;
+  IHttpRequest::HeaderParameters response_headers_;
+  std::ostream* output_ = nullptr;
+  // Receiving stopped because the callback asked to pause; only touched on
+  // the engine thread.
+  bool paused_ = false;
+};
+
+size_t write_callback(char* ptr, size_t size, size_t nmemb, void* userdata) {
+  auto t = static_cast<Transfer*>(userdata);
+  // The data is handed over again once the transfer is unpaused.
+  if (t->callback_ && t->callback_->pause()) {
+    t->paused_ = true;
+    return CURL_WRITEFUNC_PAUSE;
+  }
+  if (!t->output_) {
+    long code = 0;
+    curl_easy_getinfo(t->handle_, CURLINFO_RESPONSE_CODE, &code);
+    bool success = t->callback_
+                       ? t->callback_->isSuccess(code, t->response_headers_)
+                       : IHttpRequest::isSuccess(code);
+    t->output_ = success || !t->error_stream_ ? t->response_.get()
+                                              : t->error_stream_.get();
+  }
+  t->output_->write(ptr, size * nmemb);
+  return size * nmemb;
+}
+
+size_t header_callback(char* ptr, size_t size, size_t nmemb, void* userdata) {
+  auto t = static_cast<Transfer*>(userdata);
+  std::string header(ptr, size * nmemb);
+  if (header.compare(0, 5, "HTTP/") == 0) {
+    t->response_headers_.clear();
+    t->output_ = nullptr;
+  } else {
+    auto colon = header.find(':');
+    if (colon != std::string::npos) {
+      auto name = header.substr(0, colon);
+      std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+      auto value = header.substr(colon + 1);
+      value.erase(0, value.find_first_not_of(" \t"));
+      value.erase(value.find_last_not_of(" \t\r\n") + 1);
+      t->response_headers_.insert({name, value});
+    }
+  }
+  return size * nmemb;
+}
+
+size_t read_callback(char* buffer, size_t size, size_t nitems, void* userdata) {
+  auto t = static_cast<Transfer*>(userdata);
+  t->data_->read(buffer, size * nitems);
+  return t->data_->gcount();
+}
+
+int progress_callback(void* userdata, curl_off_t dltotal, curl_off_t dlnow,
+                      curl_off_t ultotal, curl_off_t ulnow) {
+  auto t = static_cast<Transfer*>(userdata);
+  if (t->callback_) {
+    // Called at least once a second, also while the transfer is idle, so a
+    // cancelled request stops soon even if upstream went silent.
+    if (t->callback_->abort()) return 1;
+    if (dltotal > 0) t->callback_->progressDownload(dltotal, dlnow);
+    if (ultotal > 0) t->callback_->progressUpload(ultotal, ulnow);
+  }
+  return 0;
+}
+
+std::string escape(CURL* handle, const std::string& str) {
+  auto escaped = curl_easy_escape(handle, str.c_str(), str.size());
+  std::string result = escaped;
+  curl_free(escaped);
+  return result;
+}
+
+}  // namespace
+
+class CurlMultiHttp::Engine {
+ public:
+  Engine()
+      : multi_(curl_multi_init()),
+        done_(false),
+        requests_(),
+        reused_(),
+        failed_(),
+        active_() {
+    // Handles of one multi handle already share its connection pool, dns
+    // cache and tls sessions.
+    curl_multi_setopt(multi_, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    thread_ = std::thread([=] { run(); });
+  }
+
+  ~Engine() {
+    done_ = true;
+    curl_multi_wakeup(multi_);
+    thread_.join();
+    for (auto& t : active_transfers_)
+      curl_multi_remove_handle(multi_, t->handle_);
+    for (auto& t : pending_) active_transfers_.push_back(std::move(t));
+    for (auto& t : active_transfers_)
+      t->complete_(Error{IHttpRequest::Aborted, "http engine stopped"});
+    active_transfers_.clear();
+    curl_multi_cleanup(multi_);
+  }
+
+  void add(std::unique_ptr<Transfer> t) {
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      pending_.push_back(std::move(t));
+    }
+    curl_multi_wakeup(multi_);
+  }
+
+  Stats stats() const { return {requests_, reused_, failed_, active_}; }
+
+ private:
+  void run() {
+    while (!done_) {
+      std::vector<std::unique_ptr<Transfer>> pending;
+      {
+        std::lock_guard<std::mutex> lock(lock_);
+        pending.swap(pending_);
+      }
+      for (auto& t : pending) {
+        curl_multi_add_handle(multi_, t->handle_);
+        active_transfers_.push_back(std::move(t));
+        active_++;
+      }
+      int running;
+      curl_multi_perform(multi_, &running);
+      int left;
+      while (auto message = curl_multi_info_read(multi_, &left))
+        if (message->msg == CURLMSG_DONE)
+          finish(message->easy_handle, message->data.result);
+      bool paused = resume();
+      curl_multi_poll(multi_, nullptr, 0,
+                      paused ? PAUSE_POLL_MS : POLL_TIMEOUT_MS, nullptr);
+    }
+  }
+
+  // Unpauses transfers whose callback allows it again, or wants them
+  // aborted, which the progress callback then does. Tells whether any is
+  // still paused.
+  bool resume() {
+    bool paused = false;
+    for (auto& t : active_transfers_) {
+      if (!t->paused_) continue;
+      if (t->callback_->pause() && !t->callback_->abort()) {
+        paused = true;
+      } else {
+        t->paused_ = false;
+        curl_easy_pause(t->handle_, CURLPAUSE_CONT);
+      }
+    }
+    return paused;
+  }
+
+  void finish(CURL* handle, CURLcode result) {
+    auto it = std::find_if(active_transfers_.begin(), active_transfers_.end(),
+                           [=](const auto& t) { return t->handle_ == handle; });
+    if (it == active_transfers_.end()) return;
+    auto t = std::move(*it);
+    active_transfers_.erase(it);
+    active_--;
+    curl_multi_remove_handle(multi_, handle);
+    requests_++;
+    long connects = 0;
+    curl_easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &connects);
+    if (connects == 0) reused_++;
+    if (result == CURLE_ABORTED_BY_CALLBACK)
+      return t->complete_(Error{IHttpRequest::Aborted, "aborted"});
+    if (result != CURLE_OK) {
+      failed_++;
+      return t->complete_(
+          Error{IHttpRequest::Failure, curl_easy_strerror(result)});
+    }
+    long code = 0;
+    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &code);
+    t->complete_(IHttpRequest::Response{static_cast<int>(code),
+                                        t->response_headers_, t->response_,
+                                        t->error_stream_});
+  }
+
+  CURLM* multi_;
+  std::atomic_bool done_;
+  std::mutex lock_;
+  std::vector<std::unique_ptr<Transfer>> pending_;
+  std::vector<std::unique_ptr<Transfer>> active_transfers_;
+  std::atomic<uint64_t> requests_;
+  std::atomic<uint64_t> reused_;
+  std::atomic<uint64_t> failed_;
+  std::atomic<uint64_t> active_;
+  std::thread thread_;
+};
+
+namespace {
+
+class Request : public IHttpRequest {
+ public:
+  Request(std::weak_ptr<CurlMultiHttp::Engine> engine, const std::string& url,
+          const std::string& method, bool follow_redirect)
+      : engine_(engine),
+        url_(url),
+        method_(method),
+        follow_redirect_(follow_redirect) {}
+
+  void setParameter(const std::string& parameter,
+                    const std::string& value) override {
+    parameters_[parameter] = value;
+  }
+
+  void setHeaderParameter(const std::string& parameter,
+                          const std::string& value) override {
+    header_parameters_[parameter] = value;
+  }
+
+  const GetParameters& parameters() const override { return parameters_; }
+
+  const HeaderParameters& headerParameters() const override {
+    return header_parameters_;
+  }
+
+  const std::string& url() const override { return url_; }
+
+  const std::string& method() const override { return method_; }
+
+  bool follow_redirect() const override { return follow_redirect_; }
+
+  void send(CompleteCallback on_completed, std::shared_ptr<std::istream> data,
+            std::shared_ptr<std::ostream> response,
+            std::shared_ptr<std::ostream> error_stream,
+            ICallback::Pointer callback) const override {
+    auto engine = engine_.lock();
+    if (!engine)
+      return on_completed(Error{IHttpRequest::Aborted, "http engine stopped"});
+    auto t = std::make_unique<Transfer>();
+    t->handle_ = curl_easy_init();
+    t->complete_ = on_completed;
+    t->data_ = data;
+    t->response_ = response;
+    t->error_stream_ = error_stream;
+    t->callback_ = std::move(callback);
+    auto handle = t->handle_;
+    std::string url = url_;
+    bool first = url_.find('?') == std::string::npos;
+    for (const auto& p : parameters_) {
+      url += (first ? "?" : "&") + escape(handle, p.first) + "=" +
+             escape(handle, p.second);
+      first = false;
+    }
+    for (const auto& h : header_parameters_)
+      t->headers_ =
+          curl_slist_append(t->headers_, (h.first + ": " + h.second).c_str());
+    data->seekg(0, std::istream::end);
+    curl_off_t size = data->tellg();
+    data->seekg(0, std::istream::beg);
+    if (size < 0) size = 0;
+    curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(handle, CURLOPT_HTTPHEADER, t->headers_);
+    curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION,
+                     follow_redirect_ ? 1L : 0L);
+    curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, CONNECT_TIMEOUT);
+    curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, LOW_SPEED_LIMIT);
+    curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, LOW_SPEED_TIME);
+    curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, write_callback);
+    curl_easy_setopt(handle, CURLOPT_WRITEDATA, t.get());
+    curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, header_callback);
+    curl_easy_setopt(handle, CURLOPT_HEADERDATA, t.get());
+    curl_easy_setopt(handle, CURLOPT_READFUNCTION, read_callback);
+    curl_easy_setopt(handle, CURLOPT_READDATA, t.get());
+    curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION, progress_callback);
+    curl_easy_setopt(handle, CURLOPT_XFERINFODATA, t.get());
+    curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 0L);
+    if (method_ == "POST") {
+      curl_easy_setopt(handle, CURLOPT_POST, 1L);
+      curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE_LARGE, size);
+    } else if (method_ == "HEAD") {
+      curl_easy_setopt(handle, CURLOPT_NOBODY, 1L);
+    } else if (method_ != "GET") {
+      curl_easy_setopt(handle, CURLOPT_CUSTOMREQUEST, method_.c_str());
+      if (size > 0) {
+        curl_easy_setopt(handle, CURLOPT_UPLOAD, 1L);
+        curl_easy_setopt(handle, CURLOPT_INFILESIZE_LARGE, size);
+      }
+    }
+    engine->add(std::move(t));
+  }
+
+ private:
+  std::weak_ptr<CurlMultiHttp::Engine> engine_;
+  std::string url_;
+  std::string method_;
+  bool follow_redirect_;
+  GetParameters parameters_;
+  HeaderParameters header_parameters_;
+};
+
+}  // namespace
+
+CurlMultiHttp::CurlMultiHttp() : engine_(std::make_shared<Engine>()) {}
+
+IHttpRequest::Pointer CurlMultiHttp::create(const std::string& url,
+                                            const std::string& method,
+                                            bool follow_redirect) const {
+  return std::make_shared<Request>(engine_, url, method, follow_redirect);
+}
+
+CurlMultiHttp::Stats CurlMultiHttp::stats() const { return engine_->stats(); }
@@ -0,0 +1,34 @@
+#ifndef CURL_MULTI_HTTP_H
+#define CURL_MULTI_HTTP_H
+
+#include <cloudstorage/IHttp.h>
+#include <atomic>
+#include <memory>
+
+using cloudstorage::IHttp;
+using cloudstorage::IHttpRequest;
+
+class CurlMultiHttp : public IHttp {
+ public:
+  struct Stats {
+    uint64_t requests_;
+    uint64_t reused_;
+    uint64_t failed_;
+    uint64_t active_;
+  };
+
+  CurlMultiHttp();
+
+  IHttpRequest::Pointer create(const std::string& url,
+                               const std::string& method,
+                               bool follow_redirect) const override;
+
+  Stats stats() const;
+
+  class Engine;
+
+ private:
+  std::shared_ptr<Engine> engine_;
+};
+
+#endif  // CURL_MULTI_HTTP_H
@@ -5,10 +5,9 @@
 
 using cloudstorage::MicroHttpdServer;
 
-DispatchServer::DispatchServer(MicroHttpdServerFactory* f, uint16_t port,
-                               ProxyFunction p)
+DispatchServer::DispatchServer(ServerFactory f, uint16_t port, ProxyFunction p)
     : callback_(std::make_shared<Callback>(p)),
-      http_server_(f->create(callback_, port)) {}
+      http_server_(f(callback_, port)) {}
 
 DispatchServer::Callback::Callback(ProxyFunction f) : proxy_(f) {}
 
@@ -33,6 +32,11 @@ IHttpServer::ICallback::Pointer DispatchServer::Callback::callback(
   return it == std::end(client_callbacks_) ? nullptr : it->second;
 }
 
+size_t DispatchServer::Callback::size() const {
+  std::lock_guard<std::mutex> lock(lock_);
+  return client_callbacks_.size();
+}
+
 IHttpServer::IResponse::Pointer DispatchServer::Callback::handle(
     const IHttpServer::IRequest& request) {
   if (auto ret = proxy_(request, *this)) return ret;
@@ -3,6 +3,7 @@
 
 #define WITH_MICROHTTPD
 
+#include <functional>
 #include <memory>
 #include <mutex>
 
@@ -30,6 +31,7 @@ class DispatchServer {
     void addCallback(const std::string&, ICallback::Pointer);
     void removeCallback(const std::string&);
     ICallback::Pointer callback(const std::string&) const;
+    size_t size() const;
 
    private:
     ProxyFunction proxy_;
@@ -37,7 +39,14 @@ class DispatchServer {
     mutable std::mutex lock_;
   };
 
-  DispatchServer(MicroHttpdServerFactory*, uint16_t port, ProxyFunction);
+  // Creates the server listening on |port|.
+  using ServerFactory = std::function<IHttpServer::Pointer(
+      IHttpServer::ICallback::Pointer, uint16_t port)>;
+
+  DispatchServer(ServerFactory, uint16_t port, ProxyFunction);
+
+  // Number of registered session callbacks.
+  size_t callback_count() const { return callback_->size(); }
 
  private:
   friend class ServerWrapper;
@@ -26,9 +26,16 @@
 #include "GenerateThumbnail.h"
 #include "IHttp.h"
 #include "IRequest.h"
+#include "MemoryBudget.h"
+#include "Trace.h"
 #include "Utility/Utility.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <list>
 #include <sstream>
+#include <tuple>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -44,6 +51,13 @@ extern "C" {
 namespace cloudstorage {
 
 const int THUMBNAIL_SIZE = 256;
+const int CACHED_CONTEXT_COUNT = 8;
+const int FRAME_ALIGN = 32;
+// Decoded frames a decoder typically keeps alive for reference.
+const int DECODER_FRAME_COUNT = 4;
+// Embedded jpeg / png covers up to this size are returned as they are.
+const int MAX_COVER_SIZE = 512 * 1024;
+const int IO_BUFFER_SIZE = 32 * 1024;
 
 namespace {
 
@@ -60,17 +74,117 @@ struct CallbackData {
   std::chrono::system_clock::time_point start_time_;
 };
 
+struct MemoryInput {
+  const std::string& data_;
+  size_t position_;
+};
+
 template <class T>
-using Pointer = std::unique_ptr<T, std::function<void(T*)>>;
+struct Deleter;
+
+template <>
+struct Deleter<AVFormatContext> {
+  void operator()(AVFormatContext* d) const {
+    auto data = reinterpret_cast<CallbackData*>(d->interrupt_callback.opaque);
+    avformat_close_input(&d);
+    delete data;
+  }
+};
+
+template <>
+struct Deleter<AVIOContext> {
+  void operator()(AVIOContext* d) const {
+    av_freep(&d->buffer);
+    avio_context_free(&d);
+  }
+};
+
+template <>
+struct Deleter<AVCodecContext> {
+  void operator()(AVCodecContext* d) const { avcodec_free_context(&d); }
+};
+
+template <>
+struct Deleter<AVFrame> {
+  void operator()(AVFrame* d) const { av_frame_free(&d); }
+};
+
+template <>
+struct Deleter<AVPacket> {
+  void operator()(AVPacket* d) const { av_packet_free(&d); }
+};
+
+template <>
+struct Deleter<AVFilterContext> {
+  void operator()(AVFilterContext* d) const { avfilter_free(d); }
+};
+
+template <>
+struct Deleter<AVFilterGraph> {
+  void operator()(AVFilterGraph* d) const { avfilter_graph_free(&d); }
+};
+
+template <>
+struct Deleter<SwsContext> {
+  void operator()(SwsContext* d) const { sws_freeContext(d); }
+};
+
+template <>
+struct Deleter<AVBufferPool> {
+  void operator()(AVBufferPool* d) const { av_buffer_pool_uninit(&d); }
+};
 
 template <class T>
-Pointer<T> make(T* d, std::function<void(T**)> f) {
-  return Pointer<T>(d, [=](T* d) { f(&d); });
-}
+using Pointer = std::unique_ptr<T, Deleter<T>>;
 
 template <class T>
-Pointer<T> make(T* d, std::function<void(T*)> f) {
-  return Pointer<T>(d, f);
+Pointer<T> make(T* d) {
+  return Pointer<T>(d);
+}
+
+template <class Key, class Value>
+class LruCache {
+ public:
+  LruCache(size_t capacity) : capacity_(capacity) {}
+
+  template <class Create>
+  Value& get(const Key& key, Create create) {
+    for (auto it = entries_.begin(); it != entries_.end(); it++)
+      if (it->first == key) {
+        entries_.splice(entries_.begin(), entries_, it);
+        return it->second;
+      }
+    entries_.emplace_front(key, create());
+    if (entries_.size() > capacity_) entries_.pop_back();
+    return entries_.front().second;
+  }
+
+  void erase(const Key& key) {
+    entries_.remove_if([&](const auto& e) { return e.first == key; });
+  }
+
+ private:
+  size_t capacity_;
+  std::list<std::pair<Key, Value>> entries_;
+};
+
+using ScalerKey = std::tuple<int, int, int, int, int>;
+using EncoderKey = std::tuple<int, int, int>;
+
+struct ThreadCache {
+  ThreadCache()
+      : scalers_(CACHED_CONTEXT_COUNT),
+        encoders_(CACHED_CONTEXT_COUNT),
+        buffer_pools_(CACHED_CONTEXT_COUNT) {}
+
+  LruCache<ScalerKey, Pointer<SwsContext>> scalers_;
+  LruCache<EncoderKey, Pointer<AVCodecContext>> encoders_;
+  LruCache<int, Pointer<AVBufferPool>> buffer_pools_;
+};
+
+ThreadCache& thread_cache() {
+  thread_local ThreadCache cache;
+  return cache;
 }
 
 std::string av_error(int err) {
@@ -112,7 +226,9 @@ void initialize() {
   }
 }
 
-Pointer<AVFormatContext> create_format_context(
+// Reads only the container header; streams may lack codec parameters which
+// are only known after probing packets.
+Pointer<AVFormatContext> open_format_context(
     const std::string& url,
     std::function<bool(std::chrono::system_clock::time_point)> interrupt) {
   auto context = avformat_alloc_context();
@@ -127,15 +243,58 @@ Pointer<AVFormatContext> create_format_context(
     avformat_free_context(context);
     delete data;
     check(e, "avformat_open_input");
-  } else if ((e = avformat_find_stream_info(context, nullptr)) < 0) {
-    avformat_close_input(&context);
-    delete data;
-    check(e, "avformat_find_stream_info");
   }
-  return make<AVFormatContext>(context, [data](AVFormatContext* d) {
-    avformat_close_input(&d);
-    delete data;
-  });
+  return make(context);
+}
+
+Pointer<AVFormatContext> create_format_context(
+    const std::string& url,
+    std::function<bool(std::chrono::system_clock::time_point)> interrupt) {
+  auto context = open_format_context(url, interrupt);
+  check(avformat_find_stream_info(context.get(), nullptr),
+        "avformat_find_stream_info");
+  return context;
+}
+
+Pointer<AVIOContext> create_memory_io(MemoryInput* input) {
+  auto buffer = static_cast<unsigned char*>(av_malloc(IO_BUFFER_SIZE));
+  if (!buffer) throw std::logic_error("av_malloc");
+  auto read = [](void* t, uint8_t* buffer, int size) -> int {
+    auto d = reinterpret_cast<MemoryInput*>(t);
+    auto length = std::min<size_t>(size, d->data_.size() - d->position_);
+    if (length == 0) return AVERROR_EOF;
+    memcpy(buffer, d->data_.data() + d->position_, length);
+    d->position_ += length;
+    return length;
+  };
+  auto seek = [](void* t, int64_t offset, int whence) -> int64_t {
+    auto d = reinterpret_cast<MemoryInput*>(t);
+    whence &= ~AVSEEK_FORCE;
+    if (whence == AVSEEK_SIZE) return d->data_.size();
+    if (whence == SEEK_CUR) offset += d->position_;
+    if (whence == SEEK_END) offset += d->data_.size();
+    if (offset < 0 || uint64_t(offset) > d->data_.size()) return -1;
+    d->position_ = offset;
+    return offset;
+  };
+  auto io = avio_alloc_context(buffer, IO_BUFFER_SIZE, 0, input, read,
+                               nullptr, seek);
+  if (!io) {
+    av_free(buffer);
+    throw std::logic_error("avio_alloc_context");
+  }
+  return make(io);
+}
+
+Pointer<AVFormatContext> create_format_context(AVIOContext* io) {
+  auto context = avformat_alloc_context();
+  context->pb = io;
+  check(avformat_open_input(&context, nullptr, nullptr, nullptr),
+        "avformat_open_input");
+  auto result = make(context);
+  check(avformat_find_stream_info(context, nullptr),
+        "avformat_find_stream_info");
+  return result;
 }
 
 Pointer<AVCodecContext> create_codec_context(AVFormatContext* context,
@@ -143,8 +302,7 @@ Pointer<AVCodecContext> create_codec_context(AVFormatContext* context,
   auto codec =
       avcodec_find_decoder(context->streams[stream_index]->codecpar->codec_id);
   if (!codec) throw std::logic_error("decoder not found");
-  auto codec_context =
-      make<AVCodecContext>(avcodec_alloc_context3(codec), avcodec_free_context);
+  auto codec_context = make(avcodec_alloc_context3(codec));
   check(avcodec_parameters_to_context(codec_context.get(),
                                       context->streams[stream_index]->codecpar),
         "avcodec_parameters_to_context");
@@ -153,21 +311,18 @@ Pointer<AVCodecContext> create_codec_context(AVFormatContext* context,
 }
 
 Pointer<AVPacket> create_packet() {
-  auto packet = new AVPacket;
-  av_init_packet(packet);
-  packet->data = nullptr;
-  packet->size = 0;
-  return Pointer<AVPacket>(packet, [](AVPacket* packet) {
-    av_packet_unref(packet);
-    delete packet;
-  });
+  auto packet = make(av_packet_alloc());
+  if (!packet) throw std::logic_error("av_packet_alloc");
+  return packet;
 }
 
 Pointer<AVFrame> decode_frame(AVFormatContext* context,
                               AVCodecContext* codec_context, int stream_index) {
   Pointer<AVFrame> result_frame;
   auto packet = create_packet();
+  auto frame = make(av_frame_alloc());
   while (!result_frame) {
+    av_packet_unref(packet.get());
     auto read_packet = av_read_frame(context, packet.get());
     if (read_packet != 0 && read_packet != AVERROR_EOF) {
       check(read_packet, "av_read_frame");
@@ -177,7 +332,6 @@ Pointer<AVFrame> decode_frame(AVFormatContext* context,
           codec_context, read_packet == AVERROR_EOF ? nullptr : packet.get());
       if (send_packet != AVERROR_EOF) check(send_packet, "avcodec_send_packet");
     }
-    auto frame = make<AVFrame>(av_frame_alloc(), av_frame_free);
     auto code = avcodec_receive_frame(codec_context, frame.get());
     if (code == 0) {
       result_frame = std::move(frame);
@@ -190,74 +344,101 @@ Pointer<AVFrame> decode_frame(AVFormatContext* context,
   return result_frame;
 }
 
+AVCodecContext* encoder(AVFrame* frame) {
+  auto create = [=] {
+    auto png_codec = avcodec_find_encoder(AV_CODEC_ID_PNG);
+    if (!png_codec) throw std::logic_error("png codec not found");
+    auto png_context = make(avcodec_alloc_context3(png_codec));
+    png_context->time_base = {1, 24};
+    png_context->pix_fmt = AVPixelFormat(frame->format);
+    png_context->width = frame->width;
+    png_context->height = frame->height;
+    check(avcodec_open2(png_context.get(), png_codec, nullptr),
+          "avcodec_open2");
+    return png_context;
+  };
+  return thread_cache()
+      .encoders_
+      .get(EncoderKey(frame->width, frame->height, frame->format), create)
+      .get();
+}
+
 std::string encode_frame(AVFrame* frame) {
-  auto png_codec = avcodec_find_encoder(AV_CODEC_ID_PNG);
-  if (!png_codec) throw std::logic_error("png codec not found");
-  auto png_context = make<AVCodecContext>(avcodec_alloc_context3(png_codec),
-                                          avcodec_free_context);
-  png_context->time_base = {1, 24};
-  png_context->pix_fmt = AVPixelFormat(frame->format);
-  png_context->width = frame->width;
-  png_context->height = frame->height;
-  check(avcodec_open2(png_context.get(), png_codec, nullptr), "avcodec_open2");
+  EncoderKey key(frame->width, frame->height, frame->format);
+  auto png_context = encoder(frame);
   auto packet = create_packet();
-  bool frame_sent = false, flush_sent = false;
-  std::string result;
-  while (true) {
-    if (!frame_sent) {
-      check(avcodec_send_frame(png_context.get(), frame), "avcodec_send_frame");
-      frame_sent = true;
-    } else if (!flush_sent) {
-      check(avcodec_send_frame(png_context.get(), nullptr),
-            "avcodec_send_frame");
-      flush_sent = true;
-    }
-    auto err = avcodec_receive_packet(png_context.get(), packet.get());
-    if (err != 0) {
-      if (err == AVERROR_EOF)
-        break;
-      else
-        check(err, "avcodec_receive_packet");
-    } else {
-      result +=
-          std::string(reinterpret_cast<char*>(packet->data), packet->size);
+  try {
+    check(avcodec_send_frame(png_context, frame), "avcodec_send_frame");
+    auto err = avcodec_receive_packet(png_context, packet.get());
+    if (err == AVERROR(EAGAIN)) {
+      // Encoder is holding the frame back; drain it, it can't be reused after
+      // that.
+      thread_cache().encoders_.erase(key);
+      png_context = encoder(frame);
+      check(avcodec_send_frame(png_context, frame), "avcodec_send_frame");
+      check(avcodec_send_frame(png_context, nullptr), "avcodec_send_frame");
+      err = avcodec_receive_packet(png_context, packet.get());
+      thread_cache().encoders_.erase(key);
     }
+    check(err, "avcodec_receive_packet");
+  } catch (const std::exception&) {
+    thread_cache().encoders_.erase(key);
+    throw;
   }
-  return result;
+  return std::string(reinterpret_cast<char*>(packet->data), packet->size);
+}
+
+void allocate_buffer(AVFrame* frame) {
+  auto format = AVPixelFormat(frame->format);
+  auto size = av_image_get_buffer_size(format, frame->width, frame->height,
+                                       FRAME_ALIGN);
+  check(size, "av_image_get_buffer_size");
+  auto& pool = thread_cache().buffer_pools_.get(
+      size, [=] { return make(av_buffer_pool_init(size, nullptr)); });
+  frame->buf[0] = av_buffer_pool_get(pool.get());
+  if (!frame->buf[0]) throw std::logic_error("av_buffer_pool_get");
+  check(av_image_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data,
+                             format, frame->width, frame->height, FRAME_ALIGN),
+        "av_image_fill_arrays");
+}
+
+SwsContext* scaler(AVFrame* frame, ImageSize size, AVPixelFormat format) {
+  auto create = [=] {
+    auto context = make(sws_getContext(
+        frame->width, frame->height, AVPixelFormat(frame->format), size.width_,
+        size.height_, format, SWS_BICUBIC, nullptr, nullptr, nullptr));
+    if (!context) throw std::logic_error("sws_getContext");
+    return context;
+  };
+  return thread_cache()
+      .scalers_
+      .get(ScalerKey(frame->width, frame->height, frame->format, size.width_,
+                     size.height_),
+           create)
+      .get();
 }
 
 Pointer<AVFrame> create_rgb_frame(AVFrame* frame, ImageSize size) {
   auto format = AV_PIX_FMT_RGBA;
-  auto sws_context = make<SwsContext>(
-      sws_getContext(frame->width, frame->height, AVPixelFormat(frame->format),
-                     size.width_, size.height_, format, SWS_BICUBIC, nullptr,
-                     nullptr, nullptr),
-      sws_freeContext);
-  auto rgb_frame = make<AVFrame>(av_frame_alloc(), av_frame_free);
+  auto sws_context = scaler(frame, size, format);
+  auto rgb_frame = make(av_frame_alloc());
   av_frame_copy_props(rgb_frame.get(), frame);
   rgb_frame->format = format;
   rgb_frame->width = size.width_;
   rgb_frame->height = size.height_;
-  check(av_image_alloc(rgb_frame->data, rgb_frame->linesize, size.width_,
-                       size.height_, format, 32),
-        "av_image_alloc");
-  check(sws_scale(sws_context.get(), frame->data, frame->linesize, 0,
-                  frame->height, rgb_frame->data, rgb_frame->linesize),
+  allocate_buffer(rgb_frame.get());
+  check(sws_scale(sws_context, frame->data, frame->linesize, 0, frame->height,
+                  rgb_frame->data, rgb_frame->linesize),
         "sws_scale");
-  return make<AVFrame>(rgb_frame.release(), [=](AVFrame* f) {
-    av_freep(&f->data);
-    av_frame_free(&f);
-  });
+  return rgb_frame;
 }
 
 Pointer<AVFilterContext> create_source_filter(AVFormatContext* format_context,
                                               int stream,
                                               AVCodecContext* codec_context,
                                               AVFilterGraph* graph) {
-  auto filter =
-      make<AVFilterContext>(avfilter_graph_alloc_filter(
-                                graph, avfilter_get_by_name("buffer"), nullptr),
-                            avfilter_free);
+  auto filter = make(avfilter_graph_alloc_filter(
+      graph, avfilter_get_by_name("buffer"), nullptr));
   if (!filter) {
     throw std::logic_error("filter buffer unavailable");
   }
@@ -278,10 +459,8 @@ Pointer<AVFilterContext> create_source_filter(AVFormatContext* format_context,
 }
 
 Pointer<AVFilterContext> create_sink_filter(AVFilterGraph* graph) {
-  auto filter = make<AVFilterContext>(
-      avfilter_graph_alloc_filter(graph, avfilter_get_by_name("buffersink"),
-                                  nullptr),
-      avfilter_free);
+  auto filter = make(avfilter_graph_alloc_filter(
+      graph, avfilter_get_by_name("buffersink"), nullptr));
   if (!filter) {
     throw std::logic_error("filter buffersink unavailable");
   }
@@ -290,10 +469,8 @@ Pointer<AVFilterContext> create_sink_filter(AVFilterGraph* graph) {
 }
 
 Pointer<AVFilterContext> create_thumbnail_filter(AVFilterGraph* graph) {
-  auto filter = make<AVFilterContext>(
-      avfilter_graph_alloc_filter(graph, avfilter_get_by_name("thumbnail"),
-                                  nullptr),
-      avfilter_free);
+  auto filter = make(avfilter_graph_alloc_filter(
+      graph, avfilter_get_by_name("thumbnail"), nullptr));
   if (!filter) {
     throw std::logic_error("filter thumbnail unavailable");
   }
@@ -303,10 +480,8 @@ Pointer<AVFilterContext> create_thumbnail_filter(AVFilterGraph* graph) {
 
 Pointer<AVFilterContext> create_scale_filter(AVFilterGraph* graph,
                                              ImageSize size) {
-  auto filter =
-      make<AVFilterContext>(avfilter_graph_alloc_filter(
-                                graph, avfilter_get_by_name("scale"), nullptr),
-                            avfilter_free);
+  auto filter = make(avfilter_graph_alloc_filter(
+      graph, avfilter_get_by_name("scale"), nullptr));
   if (!filter) {
     throw std::logic_error("filter thumbnail unavailable");
   }
@@ -319,6 +494,44 @@ Pointer<AVFilterContext> create_scale_filter(AVFilterGraph* graph,
   return filter;
 }
 
+uint64_t decoder_memory(AVCodecContext* context) {
+  auto size = av_image_get_buffer_size(context->pix_fmt, context->width,
+                                       context->height, FRAME_ALIGN);
+  return size > 0 ? uint64_t(size) * DECODER_FRAME_COUNT : 0;
+}
+
+// Returns the index of the embedded cover picture of a file without a proper
+// video stream, -1 if there is none.
+int cover_stream(AVFormatContext* context) {
+  int result = -1;
+  for (unsigned int i = 0; i < context->nb_streams; i++) {
+    auto stream = context->streams[i];
+    if (stream->codecpar->codec_type != AVMEDIA_TYPE_VIDEO) continue;
+    if (!(stream->disposition & AV_DISPOSITION_ATTACHED_PIC)) return -1;
+    if (result == -1 && stream->attached_pic.size > 0) result = i;
+  }
+  return result;
+}
+
+bool cover_passthrough(AVStream* stream) {
+  auto codec = stream->codecpar->codec_id;
+  return (codec == AV_CODEC_ID_MJPEG || codec == AV_CODEC_ID_PNG) &&
+         stream->attached_pic.size <= MAX_COVER_SIZE;
+}
+
+Pointer<AVFrame> decode_cover(AVFormatContext* context, int stream) {
+  auto codec_context = create_codec_context(context, stream);
+  check(avcodec_send_packet(codec_context.get(),
+                            &context->streams[stream]->attached_pic),
+        "avcodec_send_packet");
+  check(avcodec_send_packet(codec_context.get(), nullptr),
+        "avcodec_send_packet");
+  auto frame = make(av_frame_alloc());
+  check(avcodec_receive_frame(codec_context.get(), frame.get()),
+        "avcodec_receive_frame");
+  return frame;
+}
+
 ImageSize thumbnail_size(const ImageSize& i, int target) {
   if (i.width_ > i.height_) {
     return {target, i.height_ * target / i.width_};
@@ -327,6 +540,40 @@ ImageSize thumbnail_size(const ImageSize& i, int target) {
   }
 }
 
+std::string effective_url(const std::string& url) {
+#ifdef _WIN32
+  const char* file = "file:///";
+#else
+  const char* file = "file://";
+#endif
+  const auto length = strlen(file);
+  if (url.substr(0, length) == file) return url.substr(length);
+  return url;
+}
+
+Pointer<AVFrame> create_sheet(ImageSize size) {
+  auto frame = make(av_frame_alloc());
+  frame->format = AV_PIX_FMT_RGBA;
+  frame->width = size.width_;
+  frame->height = size.height_;
+  allocate_buffer(frame.get());
+  for (int i = 0; i < frame->height; i++)
+    memset(frame->data[0] + i * frame->linesize[0], 0, frame->width * 4);
+  return frame;
+}
+
+void draw_tile(AVFrame* sheet, AVFrame* frame, ImageSize size, int column,
+               int row) {
+  auto sws_context = scaler(frame, size, AV_PIX_FMT_RGBA);
+  uint8_t* data[4] = {sheet->data[0] +
+                      row * size.height_ * sheet->linesize[0] +
+                      column * size.width_ * 4};
+  int linesize[4] = {sheet->linesize[0]};
+  check(sws_scale(sws_context, frame->data, frame->linesize, 0, frame->height,
+                  data, linesize),
+        "sws_scale");
+}
+
 }  // namespace
 
 EitherError<std::string> generate_thumbnail(
@@ -334,15 +581,27 @@ EitherError<std::string> generate_thumbnail(
     std::function<bool(std::chrono::system_clock::time_point)> interrupt) {
   try {
     initialize();
-    std::string effective_url = url;
-#ifdef _WIN32
-    const char* file = "file:///";
-#else
-    const char* file = "file://";
-#endif
-    const auto length = strlen(file);
-    if (url.substr(0, length) == file) effective_url = url.substr(length);
-    auto context = create_format_context(effective_url, interrupt);
+    auto context = open_format_context(effective_url(url), interrupt);
+    trace_mark("ffmpeg open");
+    auto cover = cover_stream(context.get());
+    if (cover != -1) {
+      auto stream = context->streams[cover];
+      if (cover_passthrough(stream)) {
+        trace_mark("cover passthrough");
+        return std::string(reinterpret_cast<char*>(stream->attached_pic.data),
+                           stream->attached_pic.size);
+      }
+      auto frame = decode_cover(context.get(), cover);
+      trace_mark("ffmpeg decode");
+      auto rgb_frame = create_rgb_frame(
+          frame.get(),
+          thumbnail_size({frame->width, frame->height}, THUMBNAIL_SIZE));
+      auto result = encode_frame(rgb_frame.get());
+      trace_mark("ffmpeg encode");
+      return result;
+    }
+    check(avformat_find_stream_info(context.get(), nullptr),
+          "avformat_find_stream_info");
     auto stream = av_find_best_stream(context.get(), AVMEDIA_TYPE_VIDEO, -1, -1,
                                       nullptr, 0);
     check(stream, "av_find_best_stream");
@@ -351,10 +610,11 @@ EitherError<std::string> generate_thumbnail(
             "av_seek_frame");
     }
     auto codec_context = create_codec_context(context.get(), stream);
+    ::util::MemoryCharge charge(::util::MemoryCategory::Thumbnail,
+                                decoder_memory(codec_context.get()));
     auto size = thumbnail_size({codec_context->width, codec_context->height},
                                THUMBNAIL_SIZE);
-    auto filter_graph =
-        make<AVFilterGraph>(avfilter_graph_alloc(), avfilter_graph_free);
+    auto filter_graph = make(avfilter_graph_alloc());
     auto source_filter = create_source_filter(
         context.get(), stream, codec_context.get(), filter_graph.get());
     auto sink_filter = create_sink_filter(filter_graph.get());
@@ -369,12 +629,12 @@ EitherError<std::string> generate_thumbnail(
     check(avfilter_graph_config(filter_graph.get(), nullptr),
           "avfilter_graph_config");
     Pointer<AVFrame> frame;
+    auto received_frame = make(av_frame_alloc());
     while (auto current =
                decode_frame(context.get(), codec_context.get(), stream)) {
       frame = std::move(current);
       check(av_buffersrc_write_frame(source_filter.get(), frame.get()),
             "av_buffersrc_write_frame");
-      auto received_frame = make<AVFrame>(av_frame_alloc(), av_frame_free);
       auto err =
           av_buffersink_get_frame(sink_filter.get(), received_frame.get());
       if (err == 0) {
@@ -387,8 +647,96 @@ EitherError<std::string> generate_thumbnail(
     if (!frame) {
       throw std::logic_error("couldn't get any frame");
     }
+    trace_mark("ffmpeg decode");
     auto rgb_frame = create_rgb_frame(frame.get(), size);
-    return encode_frame(rgb_frame.get());
+    auto result = encode_frame(rgb_frame.get());
+    trace_mark("ffmpeg encode");
+    return result;
+  } catch (const std::exception& e) {
+    return Error{IHttpRequest::Failure, e.what()};
+  }
+}
+
+EitherError<std::vector<std::string>> generate_thumbnail_variants(
+    const std::string& image, const std::vector<int>& sizes) {
+  try {
+    initialize();
+    MemoryInput input{image, 0};
+    auto io = create_memory_io(&input);
+    auto context = create_format_context(io.get());
+    auto stream = av_find_best_stream(context.get(), AVMEDIA_TYPE_VIDEO, -1, -1,
+                                      nullptr, 0);
+    check(stream, "av_find_best_stream");
+    auto codec_context = create_codec_context(context.get(), stream);
+    auto frame = decode_frame(context.get(), codec_context.get(), stream);
+    if (!frame) throw std::logic_error("couldn't decode image");
+    trace_mark("ffmpeg decode");
+    std::vector<std::string> result;
+    for (auto size : sizes) {
+      if (size >= std::max(frame->width, frame->height)) {
+        result.push_back(image);
+      } else {
+        auto rgb_frame = create_rgb_frame(
+            frame.get(), thumbnail_size({frame->width, frame->height}, size));
+        result.push_back(encode_frame(rgb_frame.get()));
+      }
+    }
+    trace_mark("ffmpeg encode");
+    return result;
+  } catch (const std::exception& e) {
+    return Error{IHttpRequest::Failure, e.what()};
+  }
+}
+
+EitherError<Sprite> generate_sprite(
+    const std::string& url, int frame_count, int tile_size,
+    std::function<bool(std::chrono::system_clock::time_point)> interrupt) {
+  try {
+    initialize();
+    auto context = create_format_context(effective_url(url), interrupt);
+    trace_mark("ffmpeg open");
+    auto stream = av_find_best_stream(context.get(), AVMEDIA_TYPE_VIDEO, -1, -1,
+                                      nullptr, 0);
+    check(stream, "av_find_best_stream");
+    if (context->duration <= 0) frame_count = 1;
+    auto codec_context = create_codec_context(context.get(), stream);
+    ::util::MemoryCharge charge(::util::MemoryCategory::Thumbnail,
+                                decoder_memory(codec_context.get()));
+    auto time_base = context->streams[stream]->time_base;
+    auto size = thumbnail_size({codec_context->width, codec_context->height},
+                               tile_size);
+    auto sprite = std::make_shared<Sprite>();
+    sprite->columns_ = std::ceil(std::sqrt(frame_count));
+    sprite->rows_ = (frame_count + sprite->columns_ - 1) / sprite->columns_;
+    sprite->tile_width_ = size.width_;
+    sprite->tile_height_ = size.height_;
+    auto sheet = create_sheet({sprite->columns_ * size.width_,
+                               sprite->rows_ * size.height_});
+    charge.add(sheet->buf[0]->size);
+    for (int i = 0; i < frame_count; i++) {
+      auto target = context->duration * (2 * i + 1) / (2 * frame_count);
+      if (context->duration > 0) {
+        check(av_seek_frame(context.get(), -1, target, AVSEEK_FLAG_BACKWARD),
+              "av_seek_frame");
+        avcodec_flush_buffers(codec_context.get());
+      }
+      auto frame = decode_frame(context.get(), codec_context.get(), stream);
+      if (!frame) break;
+      draw_tile(sheet.get(), frame.get(), size, i % sprite->columns_,
+                i / sprite->columns_);
+      auto timestamp = frame->best_effort_timestamp;
+      sprite->timestamps_.push_back(
+          timestamp == AV_NOPTS_VALUE
+              ? target / 1000
+              : av_rescale_q(timestamp, time_base, {1, 1000}));
+    }
+    if (sprite->timestamps_.empty()) {
+      throw std::logic_error("couldn't get any frame");
+    }
+    trace_mark("ffmpeg decode");
+    sprite->image_ = encode_frame(sheet.get());
+    trace_mark("ffmpeg encode");
+    return sprite;
   } catch (const std::exception& e) {
     return Error{IHttpRequest::Failure, e.what()};
   }
@@ -25,14 +25,35 @@
 
 #ifdef WITH_THUMBNAILER
 
+#include <vector>
+
 #include "IRequest.h"
 
 namespace cloudstorage {
 
+struct Sprite {
+  std::string image_;
+  int columns_;
+  int rows_;
+  int tile_width_;
+  int tile_height_;
+  // Presentation time in milliseconds of each tile, in row-major order.
+  std::vector<int64_t> timestamps_;
+};
+
 EitherError<std::string> generate_thumbnail(
     const std::string& url,
     std::function<bool(std::chrono::system_clock::time_point)> interrupt);
 
+// Decodes |image| once and scales it to fit each of |sizes|. Sizes not smaller
+// than the image itself get the original bytes.
+EitherError<std::vector<std::string>> generate_thumbnail_variants(
+    const std::string& image, const std::vector<int>& sizes);
+
+EitherError<Sprite> generate_sprite(
+    const std::string& url, int frame_count, int tile_size,
+    std::function<bool(std::chrono::system_clock::time_point)> interrupt);
+
 }  // namespace cloudstorage
 
 #endif  // WITH_THUMBNAILER
@@ -0,0 +1,500 @@
+#include "HttpRecording.h"
+
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "Utility.h"
+
+using cloudstorage::EitherError;
+using cloudstorage::Error;
+using ::util::log;
+using ::util::LogLevel;
+
+using Clock = std::chrono::steady_clock;
+
+const char* REDACTED = "redacted";
+
+namespace {
+
+bool credential(const std::string& name) {
+  static const std::vector<std::string> names = {
+      "access_token", "refresh_token", "id_token",      "client_secret",
+      "code",         "code_verifier", "password",      "api_key",
+      "key",          "token",         "session_token", "secret"};
+  return std::any_of(names.begin(), names.end(), [&](const std::string& n) {
+    return strcasecmp(n.c_str(), name.c_str()) == 0;
+  });
+}
+
+// Replaces the values of credential parameters in the query of |url|.
+std::string redact_url(const std::string& url) {
+  auto query = url.find('?');
+  if (query == std::string::npos) return url;
+  auto result = url.substr(0, query + 1);
+  size_t begin = query + 1;
+  while (begin <= url.size()) {
+    auto end = std::min(url.find('&', begin), url.size());
+    auto parameter = url.substr(begin, end - begin);
+    auto equals = parameter.find('=');
+    if (equals != std::string::npos && credential(parameter.substr(0, equals)))
+      parameter = parameter.substr(0, equals + 1) + REDACTED;
+    result += parameter;
+    if (end < url.size()) result += '&';
+    begin = end + 1;
+  }
+  return result;
+}
+
+// Token endpoints answer with json carrying the credentials, those are
+// replaced; other bodies are kept as they are.
+std::string redact_body(const std::string& body) {
+  if (body.empty() || body[0] != '{') return body;
+  Json::Value json;
+  if (!Json::Reader().parse(body, json, false) || !json.isObject())
+    return body;
+  bool redacted = false;
+  for (const auto& name : json.getMemberNames())
+    if (credential(name)) {
+      json[name] = REDACTED;
+      redacted = true;
+    }
+  return redacted ? Json::FastWriter().write(json) : body;
+}
+
+// Describes what a request asks for. Headers other than Range are left out,
+// they carry credentials which differ between runs, and so are credential
+// parameters.
+Json::Value describe(const IHttpRequest& r) {
+  Json::Value result;
+  result["method"] = r.method();
+  result["url"] = redact_url(r.url());
+  for (const auto& p : r.parameters())
+    result["parameters"][p.first] = credential(p.first) ? REDACTED : p.second;
+  for (const auto& h : r.headerParameters())
+    if (strcasecmp(h.first.c_str(), "Range") == 0) result["range"] = h.second;
+  return result;
+}
+
+// Identifies requests expecting the same answer.
+std::string exchange_key(const Json::Value& description) {
+  auto key = description["method"].asString() + " " +
+             description["url"].asString();
+  const auto& parameters = description["parameters"];
+  for (const auto& name : parameters.getMemberNames())
+    key += "\n" + name + "=" + parameters[name].asString();
+  if (description.isMember("range"))
+    key += "\nRange:" + description["range"].asString();
+  return key;
+}
+
+// Forwards writes to |stream| while keeping a copy of them.
+class TeeBuffer : public std::streambuf {
+ public:
+  explicit TeeBuffer(std::shared_ptr<std::ostream> stream) : stream_(stream) {}
+
+  const std::string& data() const { return data_; }
+
+ protected:
+  int_type overflow(int_type c) override {
+    if (traits_type::eq_int_type(c, traits_type::eof()))
+      return traits_type::not_eof(c);
+    char ch = traits_type::to_char_type(c);
+    xsputn(&ch, 1);
+    return c;
+  }
+
+  std::streamsize xsputn(const char* s, std::streamsize n) override {
+    data_.append(s, n);
+    stream_->write(s, n);
+    return n;
+  }
+
+  int sync() override {
+    stream_->flush();
+    return 0;
+  }
+
+ private:
+  std::shared_ptr<std::ostream> stream_;
+  std::string data_;
+};
+
+class TeeStream : public std::ostream {
+ public:
+  explicit TeeStream(std::shared_ptr<std::ostream> stream)
+      : std::ostream(nullptr), buffer_(stream) {
+    rdbuf(&buffer_);
+  }
+
+  const std::string& data() const { return buffer_.data(); }
+
+ private:
+  TeeBuffer buffer_;
+};
+
+}  // namespace
+
+class RecordingHttp::Log {
+ public:
+  explicit Log(const std::string& path)
+      : start_(Clock::now()), file_(open(path)), recorded_(), bytes_() {
+    if (!file_) log(LogLevel::Error, "couldn't open recording", path);
+  }
+
+  Clock::time_point start() const { return start_; }
+
+  void write(Json::Value exchange, const std::string& raw_response,
+             const std::string& raw_error) {
+    auto response = redact_body(raw_response);
+    auto error = redact_body(raw_error);
+    exchange["response_size"] = Json::UInt64(response.size());
+    exchange["error_size"] = Json::UInt64(error.size());
+    auto line = Json::FastWriter().write(exchange);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!file_) return;
+    file_ << line << response << error;
+    file_.flush();
+    recorded_++;
+    bytes_ += line.size() + response.size() + error.size();
+  }
+
+  RecordingHttp::Stats stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return {recorded_, bytes_};
+  }
+
+ private:
+  // Recordings hold whatever the provider sent, they are readable by the
+  // owner only.
+  static std::ofstream open(const std::string& path) {
+#ifndef _WIN32
+    auto fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                     0600);
+    if (fd == -1) return std::ofstream();
+    fchmod(fd, 0600);
+    close(fd);
+#endif
+    return std::ofstream(path, std::ios::binary | std::ios::app);
+  }
+
+  Clock::time_point start_;
+  std::ofstream file_;
+  uint64_t recorded_;
+  uint64_t bytes_;
+  mutable std::mutex mutex_;
+};
+
+class ReplayHttp::Player {
+ public:
+  Player(const std::string& path, double latency_scale)
+      : count_(),
+        latency_scale_(std::max(0.0, latency_scale)),
+        replayed_(),
+        missing_(),
+        done_(),
+        thread_(std::bind(&Player::run, this)) {
+    load(path);
+  }
+
+  ~Player() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_ = true;
+    }
+    condition_.notify_one();
+    thread_.join();
+  }
+
+  void play(const IHttpRequest& request,
+            IHttpRequest::CompleteCallback on_completed,
+            std::shared_ptr<std::ostream> response,
+            std::shared_ptr<std::ostream> error_stream,
+            IHttpRequest::ICallback::Pointer callback) {
+    auto key = exchange_key(describe(request));
+    const Exchange* exchange = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = exchanges_.find(key);
+      if (it != exchanges_.end()) {
+        exchange = &it->second[next_[key]++ % it->second.size()];
+        replayed_++;
+      } else {
+        missing_++;
+      }
+    }
+    if (!exchange) {
+      log(LogLevel::Warning, "replay: no recorded exchange for",
+          request.method(), request.url());
+      return schedule(Clock::now(), [=] {
+        on_completed(Error{IHttpRequest::Failure, "exchange not recorded"});
+      });
+    }
+    auto delay = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double, std::micro>(
+            exchange->description_["latency"].asDouble() * latency_scale_));
+    std::shared_ptr<IHttpRequest::ICallback> progress = std::move(callback);
+    schedule(Clock::now() + delay, [=] {
+      const auto& d = exchange->description_;
+      if (d.isMember("error"))
+        return on_completed(Error{d["error"]["code"].asInt(),
+                                  d["error"]["description"].asString()});
+      auto error_output = error_stream ? error_stream : response;
+      response->write(exchange->response_.data(), exchange->response_.size());
+      error_output->write(exchange->error_.data(), exchange->error_.size());
+      auto size = exchange->response_.size() + exchange->error_.size();
+      if (progress && size > 0) progress->progressDownload(size, size);
+      IHttpRequest::HeaderParameters headers;
+      for (const auto& name : d["headers"].getMemberNames())
+        headers[name] = d["headers"][name].asString();
+      on_completed(IHttpRequest::Response{d["status"].asInt(), headers,
+                                          response, error_stream});
+    });
+  }
+
+  ReplayHttp::Stats stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return {count_, replayed_, missing_};
+  }
+
+ private:
+  struct Exchange {
+    Json::Value description_;
+    std::string response_;
+    std::string error_;
+  };
+
+  void load(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return log(LogLevel::Error, "couldn't open recording", path);
+    std::string line;
+    bool corrupt = false;
+    while (std::getline(file, line)) {
+      Exchange e;
+      if (!Json::Reader().parse(line, e.description_, false)) {
+        corrupt = true;
+        break;
+      }
+      e.response_.resize(e.description_["response_size"].asUInt64());
+      e.error_.resize(e.description_["error_size"].asUInt64());
+      file.read(&e.response_[0], e.response_.size());
+      file.read(&e.error_[0], e.error_.size());
+      if (!file) {
+        corrupt = true;
+        break;
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      exchanges_[exchange_key(e.description_)].push_back(std::move(e));
+      count_++;
+    }
+    if (corrupt)
+      log(LogLevel::Error, "replay: recording", path, "corrupt after",
+          count_, "exchanges");
+    log("replay: loaded", count_, "exchanges from", path);
+  }
+
+  void schedule(Clock::time_point time, std::function<void()> f) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      timers_.emplace(time, std::move(f));
+    }
+    condition_.notify_one();
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!done_) {
+      if (timers_.empty()) {
+        condition_.wait(lock);
+        continue;
+      }
+      auto it = timers_.begin();
+      if (it->first > Clock::now()) {
+        condition_.wait_until(lock, it->first);
+        continue;
+      }
+      auto f = std::move(it->second);
+      timers_.erase(it);
+      lock.unlock();
+      f();
+      lock.lock();
+    }
+  }
+
+  std::unordered_map<std::string, std::vector<Exchange>> exchanges_;
+  std::unordered_map<std::string, size_t> next_;
+  uint64_t count_;
+  double latency_scale_;
+  uint64_t replayed_;
+  uint64_t missing_;
+  std::multimap<Clock::time_point, std::function<void()>> timers_;
+  bool done_;
+  mutable std::mutex mutex_;
+  std::condition_variable condition_;
+  std::thread thread_;
+};
+
+namespace {
+
+class RecordedRequest : public IHttpRequest {
+ public:
+  RecordedRequest(IHttpRequest::Pointer request,
+                  std::shared_ptr<RecordingHttp::Log> log)
+      : request_(request), log_(log) {}
+
+  void setParameter(const std::string& parameter,
+                    const std::string& value) override {
+    request_->setParameter(parameter, value);
+  }
+
+  void setHeaderParameter(const std::string& parameter,
+                          const std::string& value) override {
+    request_->setHeaderParameter(parameter, value);
+  }
+
+  const GetParameters& parameters() const override {
+    return request_->parameters();
+  }
+
+  const HeaderParameters& headerParameters() const override {
+    return request_->headerParameters();
+  }
+
+  const std::string& url() const override { return request_->url(); }
+
+  const std::string& method() const override { return request_->method(); }
+
+  bool follow_redirect() const override { return request_->follow_redirect(); }
+
+  void send(CompleteCallback on_completed, std::shared_ptr<std::istream> data,
+            std::shared_ptr<std::ostream> response,
+            std::shared_ptr<std::ostream> error_stream,
+            ICallback::Pointer callback) const override {
+    auto log = log_;
+    auto exchange = describe(*this);
+    auto start_time = Clock::now();
+    exchange["time"] = Json::UInt64(
+        std::chrono::duration_cast<std::chrono::milliseconds>(start_time -
+                                                              log->start())
+            .count());
+    auto response_copy = std::make_shared<TeeStream>(response);
+    std::shared_ptr<TeeStream> error_copy;
+    if (error_stream) error_copy = std::make_shared<TeeStream>(error_stream);
+    request_->send(
+        [=](EitherError<Response> e) {
+          auto record = exchange;
+          record["latency"] = Json::UInt64(
+              std::chrono::duration_cast<std::chrono::microseconds>(
+                  Clock::now() - start_time)
+                  .count());
+          if (auto r = e.right()) {
+            record["status"] = r->http_code_;
+            for (const auto& h : r->headers_)
+              if (strcasecmp(h.first.c_str(), "Set-Cookie") != 0)
+                record["headers"][h.first] = h.second;
+            r->output_stream_ = response;
+            r->error_stream_ = error_stream;
+          } else {
+            record["error"]["code"] = e.left()->code_;
+            record["error"]["description"] = e.left()->description_;
+          }
+          log->write(record, response_copy->data(),
+                     error_copy ? error_copy->data() : "");
+          on_completed(e);
+        },
+        data, response_copy, error_copy, std::move(callback));
+  }
+
+ private:
+  IHttpRequest::Pointer request_;
+  std::shared_ptr<RecordingHttp::Log> log_;
+};
+
+class ReplayedRequest : public IHttpRequest {
+ public:
+  ReplayedRequest(std::weak_ptr<ReplayHttp::Player> player,
+                  const std::string& url, const std::string& method,
+                  bool follow_redirect)
+      : player_(player),
+        url_(url),
+        method_(method),
+        follow_redirect_(follow_redirect) {}
+
+  void setParameter(const std::string& parameter,
+                    const std::string& value) override {
+    parameters_[parameter] = value;
+  }
+
+  void setHeaderParameter(const std::string& parameter,
+                          const std::string& value) override {
+    header_parameters_[parameter] = value;
+  }
+
+  const GetParameters& parameters() const override { return parameters_; }
+
+  const HeaderParameters& headerParameters() const override {
+    return header_parameters_;
+  }
+
+  const std::string& url() const override { return url_; }
+
+  const std::string& method() const override { return method_; }
+
+  bool follow_redirect() const override { return follow_redirect_; }
+
+  void send(CompleteCallback on_completed, std::shared_ptr<std::istream>,
+            std::shared_ptr<std::ostream> response,
+            std::shared_ptr<std::ostream> error_stream,
+            ICallback::Pointer callback) const override {
+    auto player = player_.lock();
+    if (!player)
+      return on_completed(Error{IHttpRequest::Aborted, "http engine stopped"});
+    player->play(*this, on_completed, response, error_stream,
+                 std::move(callback));
+  }
+
+ private:
+  std::weak_ptr<ReplayHttp::Player> player_;
+  std::string url_;
+  std::string method_;
+  bool follow_redirect_;
+  GetParameters parameters_;
+  HeaderParameters header_parameters_;
+};
+
+}  // namespace
+
+RecordingHttp::RecordingHttp(std::shared_ptr<IHttp> http,
+                             const std::string& path)
+    : http_(http), log_(std::make_shared<Log>(path)) {}
+
+IHttpRequest::Pointer RecordingHttp::create(const std::string& url,
+                                            const std::string& method,
+                                            bool follow_redirect) const {
+  return std::make_shared<RecordedRequest>(
+      http_->create(url, method, follow_redirect), log_);
+}
+
+RecordingHttp::Stats RecordingHttp::stats() const { return log_->stats(); }
+
+ReplayHttp::ReplayHttp(const std::string& path, double latency_scale)
+    : player_(std::make_shared<Player>(path, latency_scale)) {}
+
+IHttpRequest::Pointer ReplayHttp::create(const std::string& url,
+                                         const std::string& method,
+                                         bool follow_redirect) const {
+  return std::make_shared<ReplayedRequest>(player_, url, method,
+                                           follow_redirect);
+}
+
+ReplayHttp::Stats ReplayHttp::stats() const { return player_->stats(); }
@@ -0,0 +1,70 @@
+#ifndef HTTP_RECORDING_H
+#define HTTP_RECORDING_H
+
+#include <cloudstorage/IHttp.h>
+#include <json/json.h>
+#include <atomic>
+#include <memory>
+#include <string>
+
+using cloudstorage::IHttp;
+using cloudstorage::IHttpRequest;
+
+// A recording is a sequence of upstream exchanges, each stored as a line of
+// json describing the request, the response and its latency, followed by the
+// raw response and error bodies whose sizes the line gives. Recordings can be
+// concatenated, e.g. those written by separate worker processes.
+
+// Passes requests through to |http| and appends every finished exchange to
+// the recording at |path|.
+class RecordingHttp : public IHttp {
+ public:
+  struct Stats {
+    uint64_t recorded_;
+    uint64_t bytes_;
+  };
+
+  RecordingHttp(std::shared_ptr<IHttp> http, const std::string& path);
+
+  IHttpRequest::Pointer create(const std::string& url,
+                               const std::string& method,
+                               bool follow_redirect) const override;
+
+  std::shared_ptr<IHttp> http() const { return http_; }
+  Stats stats() const;
+
+  class Log;
+
+ private:
+  std::shared_ptr<IHttp> http_;
+  std::shared_ptr<Log> log_;
+};
+
+// Answers requests from a recording without network access. Exchanges are
+// matched by method, url, parameters and requested range; repeated requests
+// get the recorded answers in order and start over once they run out. Each
+// answer is delayed by its recorded latency times |latency_scale|, so 1
+// replays at the original speed and 0 as fast as possible.
+class ReplayHttp : public IHttp {
+ public:
+  struct Stats {
+    uint64_t exchanges_;
+    uint64_t replayed_;
+    uint64_t missing_;
+  };
+
+  ReplayHttp(const std::string& path, double latency_scale);
+
+  IHttpRequest::Pointer create(const std::string& url,
+                               const std::string& method,
+                               bool follow_redirect) const override;
+
+  Stats stats() const;
+
+  class Player;
+
+ private:
+  std::shared_ptr<Player> player_;
+};
+
+#endif  // HTTP_RECORDING_H
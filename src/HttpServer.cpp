@@ -4,15 +4,31 @@ extern "C" {
 #include <libavutil/log.h>
 }
 
+#include <algorithm>
 #include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <fstream>
+#include <iomanip>
+#include <limits>
+#include <map>
 #include <queue>
 #include <sstream>
+#include <unordered_map>
+#include <unordered_set>
 
 #define WITH_CURL
 
+#include "ChunkBuffer.h"
+#include "CurlMultiHttp.h"
+#include "HttpRecording.h"
+#include "MemoryBudget.h"
+#include "ResponseBuffer.h"
+#include "SharedPortServer.h"
 #include "Utility.h"
 #include "Utility/CurlHttp.h"
+#include "Utility/Item.h"
 #include "Utility/Utility.h"
 
 #include "GenerateThumbnail.h"
@@ -20,29 +36,144 @@ extern "C" {
 using namespace std::string_literals;
 using namespace std::placeholders;
 
-using cloudstorage::util::log;
 using cloudstorage::util::response_from_string;
-using cloudstorage::util::to_base64;
 using ::util::enqueue;
+using ::util::log;
+using ::util::log_sampled;
+using ::util::LogLevel;
+using ::util::Priority;
 
 const std::string SEPARATOR = "--";
+const size_t STREAM_HIGH_WATERMARK = 1 << 20;
+const size_t STREAM_LOW_WATERMARK = 1 << 18;
+const uint64_t DEFAULT_STORE_SIZE = 256 << 20;
+const uint64_t DEFAULT_FILE_CACHE_SIZE = 64 << 20;
+const int DEFAULT_METADATA_MAX_AGE = 60;
+const int DEFAULT_LISTING_MAX_AGE = 0;
+const int DEFAULT_COMPRESSION_LEVEL = 6;
+const int DEFAULT_COMPRESSION_MIN_SIZE = 1024;
+const int DEFAULT_TREE_PARALLELISM = 4;
+const int DEFAULT_TREE_MAX_DEPTH = 32;
+const int DEFAULT_SPRITE_FRAME_COUNT = 16;
+const int MAX_SPRITE_FRAME_COUNT = 64;
+const int SPRITE_TILE_SIZE = 160;
+const std::vector<int> THUMBNAIL_VARIANTS = {64, 128, 256, 512};
+const double DEFAULT_REPLAY_LATENCY_SCALE = 1;
+const int MAX_JOB_WAIT = 30;
+const size_t MAX_POLLED_JOBS = 256;
+const auto STATUS_INTERVAL = std::chrono::seconds(1);
 
 namespace {
 
 class HttpWrapper : public IHttp {
  public:
-  HttpWrapper(std::shared_ptr<IHttp> p) : http_(p) {}
+  HttpWrapper(std::shared_ptr<IHttp> p, RateLimiter* limiter = nullptr,
+              std::shared_ptr<RateLimiter::Bucket> bucket = nullptr)
+      : http_(p), limiter_(limiter), bucket_(bucket) {}
 
   IHttpRequest::Pointer create(const std::string& url,
                                const std::string& method,
                                bool follow_redirect) const override {
-    return http_->create(url, method, follow_redirect);
+    auto request = http_->create(url, method, follow_redirect);
+    if (bucket_) request = limiter_->throttle(http_, request, bucket_);
+    if (auto trace = Trace::current())
+      return std::make_shared<TracedRequest>(request, trace);
+    return request;
   }
 
  private:
+  class TracedRequest : public IHttpRequest {
+   public:
+    TracedRequest(IHttpRequest::Pointer request, Trace::Pointer trace)
+        : request_(request), trace_(trace) {}
+
+    void setParameter(const std::string& parameter,
+                      const std::string& value) override {
+      request_->setParameter(parameter, value);
+    }
+
+    void setHeaderParameter(const std::string& parameter,
+                            const std::string& value) override {
+      request_->setHeaderParameter(parameter, value);
+    }
+
+    const GetParameters& parameters() const override {
+      return request_->parameters();
+    }
+
+    const HeaderParameters& headerParameters() const override {
+      return request_->headerParameters();
+    }
+
+    const std::string& url() const override { return request_->url(); }
+
+    const std::string& method() const override { return request_->method(); }
+
+    bool follow_redirect() const override {
+      return request_->follow_redirect();
+    }
+
+    void send(CompleteCallback on_completed,
+              std::shared_ptr<std::istream> data,
+              std::shared_ptr<std::ostream> response,
+              std::shared_ptr<std::ostream> error_stream,
+              ICallback::Pointer callback) const override {
+      auto trace = trace_;
+      trace->mark("upstream request");
+      request_->send(
+          [=](EitherError<Response> e) {
+            Trace::Scope scope(trace);
+            trace->mark("upstream response");
+            on_completed(e);
+          },
+          data, response, error_stream, std::move(callback));
+    }
+
+   private:
+    IHttpRequest::Pointer request_;
+    Trace::Pointer trace_;
+  };
+
   std::shared_ptr<IHttp> http_;
+  RateLimiter* limiter_;
+  std::shared_ptr<RateLimiter::Bucket> bucket_;
 };
 
+// Creates the engine for upstream requests. With http_recording set, the
+// exchanges are either recorded to a file or replayed from one, so that
+// benchmarks can run against recorded provider traffic without network.
+std::shared_ptr<IHttp> make_http(const Json::Value& config,
+                                 WorkerStatus* status) {
+  const auto& recording = config["http_recording"];
+  auto mode = recording["mode"].asString();
+  auto path = recording["path"].asString();
+  if (mode == "replay")
+    return std::make_shared<ReplayHttp>(
+        path, recording.get("latency_scale", DEFAULT_REPLAY_LATENCY_SCALE)
+                  .asDouble());
+  auto http = config["http_engine"].asString() == "curl"
+                  ? std::shared_ptr<IHttp>(std::make_shared<curl::CurlHttp>())
+                  : std::make_shared<CurlMultiHttp>();
+  if (mode != "record") return http;
+  // Workers record to separate files, which can be concatenated.
+  if (status) path += "." + std::to_string(status->index());
+  return std::make_shared<RecordingHttp>(http, path);
+}
+
+// Workers of a group listen on the same port, which libcloudstorage's server
+// can't do.
+DispatchServer::ServerFactory server_factory(MicroHttpdServerFactory* factory,
+                                             WorkerStatus* status) {
+  if (status)
+    return [](IHttpServer::ICallback::Pointer callback, uint16_t port) {
+      return IHttpServer::Pointer(
+          std::make_unique<SharedPortServer>(callback, port));
+    };
+  return [=](IHttpServer::ICallback::Pointer callback, uint16_t port) {
+    return factory->create(callback, port);
+  };
+}
+
 std::string file_type_to_string(IItem::FileType type) {
   switch (type) {
     case IItem::FileType::Audio:
@@ -60,6 +191,135 @@ std::string file_type_to_string(IItem::FileType type) {
   }
 }
 
+Json::Value item_to_json(IItem::Pointer i) {
+  Json::Value v;
+  v["id"] = i->id();
+  v["filename"] = i->filename();
+  v["type"] = file_type_to_string(i->type());
+  return v;
+}
+
+std::string store_key(std::shared_ptr<ICloudProvider> p,
+                      const std::string& type, const std::string& id) {
+  return type + SEPARATOR + p->name() + SEPARATOR + p->token() + SEPARATOR +
+         id;
+}
+
+// |size| 0 stands for the thumbnail as the provider (or ffmpeg) returned it.
+std::string thumbnail_key(std::shared_ptr<ICloudProvider> p, IItem::Pointer i,
+                          int size = 0) {
+  auto key = store_key(
+      p, "thumbnail",
+      i->id() + SEPARATOR + std::to_string(i->size()) + SEPARATOR +
+          std::to_string(i->timestamp().time_since_epoch().count()));
+  if (size != 0) key += SEPARATOR + std::to_string(size);
+  return key;
+}
+
+// Rounds the requested size up to the closest variant.
+int thumbnail_variant(const char* size) {
+  if (!size) return 0;
+  auto requested = std::atoi(size);
+  if (requested <= 0) return 0;
+  for (auto v : THUMBNAIL_VARIANTS)
+    if (v >= requested) return v;
+  return THUMBNAIL_VARIANTS.back();
+}
+
+std::string sprite_key(std::shared_ptr<ICloudProvider> p, IItem::Pointer i,
+                       int frame_count) {
+  auto timestamp = i->timestamp().time_since_epoch().count();
+  return store_key(p, "sprite",
+                   i->id() + SEPARATOR + std::to_string(i->size()) +
+                       SEPARATOR + std::to_string(timestamp) + SEPARATOR +
+                       std::to_string(frame_count));
+}
+
+std::string job_key(std::shared_ptr<ICloudProvider> p,
+                    const IHttpServer::IRequest& r) {
+  auto param = [&](const char* name) {
+    auto value = r.get(name);
+    return value ? value : "";
+  };
+  return store_key(p, "job" + r.url(),
+                   param("item_id") + SEPARATOR + param("size") + SEPARATOR +
+                       param("count"));
+}
+
+int sprite_frame_count(const char* count) {
+  if (!count) return DEFAULT_SPRITE_FRAME_COUNT;
+  return std::max(1, std::min<int>(MAX_SPRITE_FRAME_COUNT, std::atoi(count)));
+}
+
+// Makes ffmpeg read the item through this server's /files endpoint, so it
+// gets range support regardless of the provider.
+std::string local_url(std::shared_ptr<ICloudProvider> p, std::string url,
+                      bool secure, uint16_t port) {
+  auto file_url = p->hints()["file_url"];
+  if (!file_url.empty() && url.length() >= file_url.length()) {
+    if (url.substr(0, file_url.length()) == file_url) {
+      auto rest = std::string(url.begin() + file_url.length(), url.end());
+      url = (secure ? "https" : "http") + "://127.0.0.1:"s +
+            std::to_string(port) + rest;
+    }
+  }
+  return url;
+}
+
+std::string listing_key(std::shared_ptr<ICloudProvider> p,
+                        const std::string& item_id,
+                        const std::string& page_token) {
+  return store_key(p, "listing", item_id + SEPARATOR + page_token);
+}
+
+std::string make_etag(const std::string& data) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (unsigned char c : data) {
+    hash ^= c;
+    hash *= 0x100000001b3ULL;
+  }
+  std::stringstream stream;
+  stream << '"' << std::hex << std::setw(16) << std::setfill('0') << hash
+         << '"';
+  return stream.str();
+}
+
+// Identifies a version of something derived from |i|. Only the item's own
+// version goes in, so that tags survive token refreshes.
+std::string item_etag(IItem::Pointer i, const std::string& variant) {
+  return make_etag(i->id() + SEPARATOR + std::to_string(i->size()) +
+                   SEPARATOR +
+                   std::to_string(i->timestamp().time_since_epoch().count()) +
+                   SEPARATOR + variant);
+}
+
+// Compressed and identity bodies differ, so each coding gets its own strong
+// tag.
+std::string coded_etag(const std::string& tag, Encoding encoding) {
+  if (tag.empty() || encoding == Encoding::Identity) return tag;
+  return tag.substr(0, tag.size() - 1) + "-" + encoding_name(encoding) + '"';
+}
+
+bool etag_matches(const std::string& if_none_match, const std::string& tag) {
+  if (if_none_match.empty() || tag.empty()) return false;
+  std::stringstream stream(if_none_match);
+  std::string candidate;
+  while (std::getline(stream, candidate, ',')) {
+    auto begin = candidate.find_first_not_of(" \t");
+    if (begin == std::string::npos) continue;
+    auto end = candidate.find_last_not_of(" \t");
+    candidate = candidate.substr(begin, end - begin + 1);
+    // If-None-Match uses the weak comparison function.
+    if (candidate.compare(0, 2, "W/") == 0) candidate = candidate.substr(2);
+    if (candidate == "*" || candidate == tag) return true;
+  }
+  return false;
+}
+
+std::string tenant(std::shared_ptr<ICloudProvider> p) {
+  return p->name() + SEPARATOR + p->token();
+}
+
 Json::Value session(std::shared_ptr<ICloudProvider> p) {
   Json::Value result;
   result["token"] = p->token();
@@ -69,38 +329,255 @@ Json::Value session(std::shared_ptr<ICloudProvider> p) {
   return result;
 }
 
-struct Buffer {
-  void resume() {
-    if (suspended_ && response_) {
-      suspended_ = false;
-      response_->resume();
+class DirectoryStream : public std::enable_shared_from_this<DirectoryStream> {
+ public:
+  DirectoryStream(std::shared_ptr<ICloudProvider> p, HttpServer* server,
+                  IItem::Pointer directory, size_t limit,
+                  ResponseBuffer::Pointer buffer,
+                  HttpCloudProvider::Completed c)
+      : p_(p),
+        server_(server),
+        directory_(directory),
+        limit_(limit),
+        buffer_(buffer),
+        c_(c),
+        listed_(),
+        next_page_() {}
+
+  void fetch(const std::string& page_token, int page) {
+    if (buffer_->detached()) return;
+    auto self = shared_from_this();
+    server_->add(p_, p_->listDirectoryPageAsync(
+                         directory_, page_token,
+                         [=](auto list) { self->received(page, list); }));
+  }
+
+ private:
+  void received(int page, EitherError<PageData> list) {
+    if (list.left()) {
+      return commit(page, "", HttpCloudProvider::error(p_, *list.left()));
+    }
+    const auto& items = list.right()->items_;
+    size_t first, count;
+    bool more;
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      first = listed_;
+      count = listed_ = std::min(limit_, listed_ + items.size());
+      more = !list.right()->next_token_.empty() && listed_ < limit_;
+    }
+    if (more) {
+      auto self = shared_from_this();
+      auto next_token = list.right()->next_token_;
+      auto fetch = [=] { self->fetch(next_token, page + 1); };
+      if (buffer_->size() < STREAM_HIGH_WATERMARK)
+        fetch();
+      else
+        buffer_->on_drain(STREAM_LOW_WATERMARK, fetch);
+    }
+    std::string output;
+    Json::FastWriter writer;
+    for (size_t i = 0; i < items.size() && first + i < limit_; i++)
+      output += writer.write(item_to_json(items[i]));
+    Json::Value summary;
+    if (!more) {
+      summary = session(p_);
+      summary["count"] = Json::UInt64(count);
     }
+    commit(page, std::move(output), summary);
   }
 
+  void commit(int page, std::string&& output, Json::Value summary) {
+    std::lock_guard<std::mutex> lock(lock_);
+    pending_[page] = {std::move(output), summary};
+    for (auto it = pending_.begin();
+         it != pending_.end() && it->first == next_page_;
+         it = pending_.erase(it), next_page_++) {
+      buffer_->write(std::move(it->second.first));
+      if (!it->second.second.isNull()) return c_(it->second.second);
+    }
+    buffer_->flush();
+  }
+
+  std::shared_ptr<ICloudProvider> p_;
+  HttpServer* server_;
+  IItem::Pointer directory_;
+  size_t limit_;
+  ResponseBuffer::Pointer buffer_;
+  HttpCloudProvider::Completed c_;
   std::mutex lock_;
-  std::stringstream result_;
-  bool ready_ = false;
-  bool suspended_ = false;
-  IHttpServer::IResponse* response_;
+  size_t listed_;
+  int next_page_;
+  std::map<int, std::pair<std::string, Json::Value>> pending_;
 };
 
-class ResponseCallback : public IHttpServer::IResponse::ICallback {
+// Walks a folder tree breadth first with at most |parallelism| listings in
+// flight. Further pages of a folder are requested as soon as the previous one
+// arrives and entries are written out in the order they come in, each with
+// the id of its parent.
+class TreeWalker : public std::enable_shared_from_this<TreeWalker> {
  public:
-  ResponseCallback(std::shared_ptr<Buffer> p) : buffer_(p) {}
+  TreeWalker(std::shared_ptr<ICloudProvider> p, HttpServer* server,
+             int parallelism, int max_depth, size_t limit,
+             ResponseBuffer::Pointer buffer, HttpCloudProvider::Completed c)
+      : p_(p),
+        server_(server),
+        parallelism_(parallelism),
+        max_depth_(max_depth),
+        limit_(limit),
+        buffer_(buffer),
+        c_(c),
+        running_(),
+        listed_(),
+        folders_(),
+        errors_(),
+        paused_(),
+        finished_() {}
 
-  int putData(char* buffer, size_t size) override {
-    std::lock_guard<std::mutex> lock(buffer_->lock_);
-    if (!buffer_->ready_) {
-      buffer_->suspended_ = true;
-      return Suspend;
+  void start(IItem::Pointer root) {
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      visited_.insert(root->id());
+      queue_.push_back({root, "", 1});
     }
-    auto r = buffer_->result_.readsome(buffer, size);
-    if (r == 0) return End;
-    return r;
+    dispatch();
   }
 
  private:
-  std::shared_ptr<Buffer> buffer_;
+  struct Listing {
+    IItem::Pointer directory_;
+    std::string page_token_;
+    int depth_;
+  };
+
+  void dispatch() {
+    std::vector<Listing> ready;
+    bool finished = false, drain = false;
+    Json::Value summary;
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      if (buffer_->detached() || listed_ >= limit_) queue_.clear();
+      if (buffer_->size() >= STREAM_HIGH_WATERMARK && !queue_.empty()) {
+        drain = !paused_;
+        paused_ = true;
+      } else {
+        while (running_ < parallelism_ && !queue_.empty()) {
+          ready.push_back(std::move(queue_.front()));
+          queue_.pop_front();
+          running_++;
+        }
+      }
+      // Listings write their entries before giving up their slot, so once
+      // none is running everything has been written.
+      finished = running_ == 0 && queue_.empty() && !finished_;
+      if (finished) {
+        finished_ = true;
+        summary = session(p_);
+        summary["count"] = Json::UInt64(listed_);
+        summary["folders"] = Json::UInt64(folders_);
+        summary["errors"] = Json::UInt64(errors_);
+      }
+    }
+    if (drain) {
+      auto self = shared_from_this();
+      buffer_->on_drain(STREAM_LOW_WATERMARK, [=] {
+        {
+          std::lock_guard<std::mutex> lock(self->lock_);
+          self->paused_ = false;
+        }
+        self->dispatch();
+      });
+    }
+    for (const auto& l : ready) list(l);
+    if (finished) c_(summary);
+  }
+
+  void list(const Listing& l) {
+    auto self = shared_from_this();
+    server_->add(p_,
+                 p_->listDirectoryPageAsync(
+                     l.directory_, l.page_token_,
+                     [=](EitherError<PageData> page) {
+                       self->received(l, page);
+                     }));
+  }
+
+  void received(const Listing& l, EitherError<PageData> page) {
+    std::string output;
+    Json::FastWriter writer;
+    {
+      // The buffer takes one writer at a time, so pages are written while
+      // holding the lock.
+      std::lock_guard<std::mutex> lock(lock_);
+      running_--;
+      if (page.left()) {
+        errors_++;
+        auto e = HttpCloudProvider::error(p_, *page.left());
+        e["parent"] = l.directory_->id();
+        output = writer.write(e);
+      } else {
+        if (!page.right()->next_token_.empty())
+          queue_.push_front({l.directory_, page.right()->next_token_,
+                             l.depth_});
+        for (const auto& i : page.right()->items_) {
+          if (listed_ >= limit_) break;
+          listed_++;
+          auto v = item_to_json(i);
+          v["parent"] = l.directory_->id();
+          v["depth"] = l.depth_;
+          output += writer.write(v);
+          if (i->type() == IItem::FileType::Directory &&
+              l.depth_ < max_depth_ && visited_.insert(i->id()).second) {
+            folders_++;
+            queue_.push_back({i, "", l.depth_ + 1});
+          }
+        }
+      }
+      buffer_->write(std::move(output));
+      buffer_->flush();
+    }
+    dispatch();
+  }
+
+  std::shared_ptr<ICloudProvider> p_;
+  HttpServer* server_;
+  int parallelism_;
+  int max_depth_;
+  size_t limit_;
+  ResponseBuffer::Pointer buffer_;
+  HttpCloudProvider::Completed c_;
+  std::mutex lock_;
+  std::deque<Listing> queue_;
+  std::unordered_set<std::string> visited_;
+  int running_;
+  size_t listed_;
+  size_t folders_;
+  size_t errors_;
+  bool paused_;
+  bool finished_;
+};
+
+// Returns the path of |r|, copied into |buffer| unless the server hands it
+// out directly.
+const char* request_path(const IHttpServer::IRequest& r, std::string* buffer) {
+  if (auto request = dynamic_cast<const PathRequest*>(&r))
+    return request->path();
+  *buffer = r.url();
+  return buffer->c_str();
+}
+
+struct PathHash {
+  size_t operator()(const char* path) const {
+    size_t hash = 0;
+    for (; *path; path++) hash = hash * 31 + static_cast<unsigned char>(*path);
+    return hash;
+  }
+};
+
+struct PathEqual {
+  bool operator()(const char* a, const char* b) const {
+    return strcmp(a, b) == 0;
+  }
 };
 
 }  // namespace
@@ -111,7 +588,31 @@ CloudConfig::CloudConfig(const Json::Value& config)
       youtube_dl_url_(config["youtube_dl_url"].asString()),
       temporary_directory_(config["temporary_directory"].asString()),
       keys_(config["keys"]),
-      secure_(!config["ssl_key"].empty()) {}
+      secure_(!config["ssl_key"].empty()),
+      store_size_(config.isMember("store_size")
+                      ? config["store_size"].asUInt64()
+                      : DEFAULT_STORE_SIZE),
+      file_cache_size_(config.isMember("file_cache_size")
+                           ? config["file_cache_size"].asUInt64()
+                           : DEFAULT_FILE_CACHE_SIZE),
+      metadata_max_age_(config.isMember("metadata_max_age")
+                            ? config["metadata_max_age"].asInt()
+                            : DEFAULT_METADATA_MAX_AGE),
+      listing_max_age_(config.isMember("listing_max_age")
+                           ? config["listing_max_age"].asInt()
+                           : DEFAULT_LISTING_MAX_AGE),
+      compression_level_(config["compression"].isMember("level")
+                             ? config["compression"]["level"].asInt()
+                             : DEFAULT_COMPRESSION_LEVEL),
+      compression_min_size_(config["compression"].isMember("min_size")
+                                ? config["compression"]["min_size"].asUInt()
+                                : DEFAULT_COMPRESSION_MIN_SIZE),
+      tree_parallelism_(std::max(1, config["tree"].isMember("parallelism")
+                                        ? config["tree"]["parallelism"].asInt()
+                                        : DEFAULT_TREE_PARALLELISM)),
+      tree_max_depth_(config["tree"].isMember("max_depth")
+                          ? config["tree"]["max_depth"].asInt()
+                          : DEFAULT_TREE_MAX_DEPTH) {}
 
 std::unique_ptr<ICloudProvider::Hints> CloudConfig::hints(
     const std::string& provider) const {
@@ -127,74 +628,256 @@ std::unique_ptr<ICloudProvider::Hints> CloudConfig::hints(
   return p;
 }
 
+// An entry of the route table. The flags select the stages handle() wraps
+// around the handler, so that an endpoint gets admission control, tracing,
+// conditional requests and compression by being listed in route().
+struct HttpServer::ConnectionCallback::Route {
+  using ProviderHandler = std::function<void(
+      HttpCloudProvider&, std::shared_ptr<ICloudProvider>, HttpServer*,
+      const IHttpServer::IRequest&, ResponseBuffer::Pointer,
+      HttpCloudProvider::Completed)>;
+  using JsonHandler =
+      std::function<Json::Value(HttpServer*, const IHttpServer::IRequest&)>;
+  using ResponseHandler = std::function<IHttpServer::IResponse::Pointer(
+      HttpServer*, const IHttpServer::IRequest&)>;
+
+  // Requests naming a provider, their result is streamed through a
+  // ResponseBuffer.
+  ProviderHandler provider_;
+  // Requests answered right away with a json document.
+  JsonHandler json_;
+  // Requests producing their own response.
+  ResponseHandler response_;
+  // Class checked against the memory budget before a provider request runs.
+  Priority priority_ = Priority::Interactive;
+  // How If-None-Match is checked against HttpCloudProvider::cached_etag.
+  HttpCloudProvider::Cached cached_ = HttpCloudProvider::Cached::None;
+  // Whether the request can be submitted as a job with the async parameter.
+  bool async_ = false;
+  bool ndjson_ = false;
+  bool compressed_ = true;
+  bool logged_ = true;
+};
+
+const HttpServer::ConnectionCallback::Route*
+HttpServer::ConnectionCallback::route(const char* path) {
+  static const auto routes = [] {
+    std::unordered_map<const char*, Route, PathHash, PathEqual> r;
+    r["/exchange_code"].provider_ = [](auto& p, auto d, auto s, auto& c,
+                                       auto, auto f) {
+      p.exchange_code(d, s, c.get("code"), f);
+    };
+
+    auto& list_directory = r["/list_directory"];
+    list_directory.provider_ = [](auto& p, auto d, auto s, auto& c, auto,
+                                  auto f) {
+      p.list_directory(d, s, c.get("item_id"), c.get("page_token"), f);
+    };
+    list_directory.cached_ = HttpCloudProvider::Cached::Listing;
+
+    auto& list_directory_all = r["/list_directory_all"];
+    list_directory_all.provider_ = [](auto& p, auto d, auto s, auto& c,
+                                      auto buffer, auto f) {
+      p.list_directory_all(d, s, c.get("item_id"), c.get("limit"), buffer, f);
+    };
+    list_directory_all.priority_ = Priority::Thumbnail;
+    list_directory_all.ndjson_ = true;
+
+    auto& tree = r["/tree"];
+    tree.provider_ = [](auto& p, auto d, auto s, auto& c, auto buffer,
+                        auto f) {
+      p.tree(d, s, c.get("item_id"), c.get("depth"), c.get("limit"), buffer,
+             f);
+    };
+    tree.priority_ = Priority::Thumbnail;
+    tree.ndjson_ = true;
+
+    r["/get_item_data"].provider_ = [](auto& p, auto d, auto s, auto& c,
+                                       auto, auto f) {
+      p.get_item_data(d, s, c.get("item_id"), f);
+    };
+
+    auto& thumbnail = r["/thumbnail"];
+    thumbnail.provider_ = [](auto& p, auto d, auto s, auto& c, auto, auto f) {
+      p.thumbnail(d, s, c.get("item_id"), c.get("size"), f);
+    };
+    thumbnail.priority_ = Priority::Thumbnail;
+    thumbnail.cached_ = HttpCloudProvider::Cached::Thumbnail;
+    thumbnail.async_ = true;
+    thumbnail.compressed_ = false;
+
+    auto& sprite = r["/thumbnail_sprite"];
+    sprite.provider_ = [](auto& p, auto d, auto s, auto& c, auto, auto f) {
+      p.thumbnail_sprite(d, s, c.get("item_id"), c.get("count"), f);
+    };
+    sprite.priority_ = Priority::Thumbnail;
+    sprite.cached_ = HttpCloudProvider::Cached::Sprite;
+    sprite.async_ = true;
+    sprite.compressed_ = false;
+
+    r["/list_providers"].json_ = [](HttpServer* s, auto& c) {
+      return s->list_providers(c);
+    };
+    r["/metrics"].json_ = [](HttpServer* s, auto&) { return s->metrics(); };
+    r["/debug/requests"].json_ = [](HttpServer* s, auto&) {
+      return s->recorder_.dump();
+    };
+    r["/thumbnail_jobs"].response_ = [](HttpServer* s, auto& c) {
+      return s->thumbnail_jobs(c);
+    };
+    r["/quit"].json_ = [](HttpServer* s, auto&) {
+      s->semaphore_.set_value(0);
+      return Json::Value(Json::objectValue);
+    };
+
+    auto& health_check = r["/health_check"];
+    health_check.json_ = [](HttpServer*, auto&) {
+      return Json::Value(Json::objectValue);
+    };
+    health_check.logged_ = false;
+    return r;
+  }();
+  auto it = routes.find(path);
+  return it != routes.end() ? &it->second : nullptr;
+}
+
 IHttpServer::IResponse::Pointer HttpServer::ConnectionCallback::handle(
     const IHttpServer::IRequest& c) {
-  Json::Value result(Json::objectValue);
   if (server_->done_)
     return response_from_string(c, IHttpRequest::ServiceUnavailable, {}, "");
-  if (c.url() == "/quit") {
-    server_->semaphore_.set_value(0);
-  } else {
-    const char* provider = c.get("provider");
-    if (provider) {
-      HttpCloudProvider p(server_->config_);
-      auto r = p.provider(server_, c);
-      if (!r) {
-        result["error"] = "invalid provider";
-      } else {
-        auto start_time = std::chrono::system_clock::now();
-        auto buffer = std::make_shared<Buffer>();
-        auto cb = std::make_unique<ResponseCallback>(buffer);
-        auto url = c.url();
-        auto response =
-            c.response(IHttpRequest::Ok, {{"Content-Type", "application/json"}},
-                       IHttpServer::IResponse::UnknownSize, std::move(cb));
-        buffer->response_ = response.get();
-        response->completed([=]() {
-          std::lock_guard<std::mutex> lock(buffer->lock_);
-          buffer->response_ = nullptr;
-        });
-        auto func = [=](auto e) {
-          std::lock_guard<std::mutex> lock(buffer->lock_);
-          buffer->result_ << Json::StyledWriter().write(e);
-          buffer->ready_ = true;
-          buffer->resume();
-          log(url, "lasted",
-              std::chrono::duration<double>(std::chrono::system_clock::now() -
-                                            start_time)
-                  .count());
-        };
-        if (c.url() == "/exchange_code"s) {
-          p.exchange_code(r, server_, c.get("code"), func);
-        } else if (c.url() == "/list_directory"s) {
-          p.list_directory(r, server_, c.get("item_id"), c.get("page_token"),
-                           func);
-        } else if (c.url() == "/get_item_data"s) {
-          p.get_item_data(r, server_, c.get("item_id"), func);
-        } else if (c.url() == "/thumbnail"s) {
-          p.thumbnail(r, server_, c.get("item_id"), func);
-        } else {
-          result["error"] = "bad request";
-          func(result);
-        }
-        return response;
-      }
-    } else {
-      if (c.url() == "/list_providers"s)
-        result = server_->list_providers(c);
-      else
-        result["error"] = "invalid request";
-    }
+  std::string url;
+  auto path = request_path(c, &url);
+  auto route = this->route(path);
+  if (route && route->provider_ && c.get("provider")) {
+    if (url.empty()) url = path;
+    return provider_request(c, url, *route);
   }
+  if (route && route->response_) return route->response_(server_, c);
+  Json::Value result(Json::objectValue);
+  if (route && route->json_)
+    result = route->json_(server_, c);
+  else
+    result["error"] = "invalid request";
+  if (!route || route->logged_) log_sampled(path, "received");
+  return json_response(c, result);
+}
 
-  if (c.url() != "/health_check") log(c.url(), "received");
+IHttpServer::IResponse::Pointer
+HttpServer::ConnectionCallback::provider_request(
+    const IHttpServer::IRequest& c, const std::string& url,
+    const Route& route) {
+  auto trace = std::make_shared<Trace>(&server_->recorder_, url);
+  Trace::Scope scope(trace);
+  HttpCloudProvider p(server_->config_);
+  auto r = p.provider(server_, c);
+  if (!r) {
+    trace->finish(true);
+    log_sampled(url, "received");
+    Json::Value result;
+    result["error"] = "invalid provider";
+    return json_response(c, result);
+  }
+  auto start_time = std::chrono::system_clock::now();
+  trace->mark("provider");
+  if (!::util::memory_admit(route.priority_)) {
+    log(LogLevel::Warning, "memory budget exceeded, rejecting", url);
+    trace->finish(true);
+    return response_from_string(c, IHttpRequest::ServiceUnavailable,
+                                {{"Retry-After", "1"}}, "");
+  }
+  const auto& config = server_->config_;
+  auto encoding = route.compressed_ && config.compression_level_ > 0
+                      ? negotiate_encoding(c.header("Accept-Encoding"))
+                      : Encoding::Identity;
+  // Tags are only known up front when the result can be derived from the
+  // store; a response for something not cached yet goes out without one and
+  // the next request for it gets a tag.
+  auto tag =
+      route.cached_ != HttpCloudProvider::Cached::None
+          ? coded_etag(p.cached_etag(r, server_, c, route.cached_), encoding)
+          : "";
+  if (etag_matches(c.header("If-None-Match") ? c.header("If-None-Match") : "",
+                   tag)) {
+    log_sampled(url, "not modified");
+    trace->finish();
+    IHttpServer::IResponse::Headers headers = {{"ETag", tag}};
+    if (route.compressed_) headers["Vary"] = "Accept-Encoding";
+    return response_from_string(c, IHttpRequest::NotModified, headers, "");
+  }
+  if (route.async_ && c.get("async")) {
+    // The connection is released right away, the result is collected
+    // through /thumbnail_jobs.
+    auto server = server_;
+    Json::Value job;
+    job["job"] = server_->jobs_.submit(
+        job_key(r, c), [&](JobRegistry::Completed done) {
+          auto job_trace =
+              std::make_shared<Trace>(&server->recorder_, url + " job");
+          Trace::Scope scope(job_trace);
+          route.provider_(p, r, server, c, nullptr, [=](Json::Value e) {
+            job_trace->finish(e.isMember("error"));
+            // Anyone knowing the id can read the result, it must not carry
+            // credentials.
+            e.removeMember("token");
+            e.removeMember("access_token");
+            done(e);
+          });
+        });
+    trace->finish();
+    return response_from_string(c, IHttpRequest::Ok,
+                                {{"Content-Type", "application/json"}},
+                                Json::StyledWriter().write(job));
+  }
+  auto buffer = std::make_shared<ResponseBuffer>();
+  auto cb = std::make_unique<ResponseCallback>(buffer);
+  auto ndjson = route.ndjson_;
+  IHttpServer::IResponse::Headers headers = {
+      {"Content-Type", ndjson ? "application/x-ndjson" : "application/json"}};
+  if (!tag.empty()) headers["ETag"] = tag;
+  // Headers go out before the result exists, so compression_min_size_ can't
+  // be checked here.
+  if (encoding != Encoding::Identity) {
+    headers["Content-Encoding"] = encoding_name(encoding);
+    headers["Vary"] = "Accept-Encoding";
+    buffer->compress(encoding, config.compression_level_);
+  }
+  auto response = c.response(IHttpRequest::Ok, headers,
+                             IHttpServer::IResponse::UnknownSize,
+                             std::move(cb));
+  buffer->attach(response.get());
+  response->completed([=]() { buffer->detach(); });
+  route.provider_(p, r, server_, c, buffer, [=](Json::Value e) {
+    trace->finish(e.isMember("error"));
+    buffer->write(ndjson ? Json::FastWriter().write(e)
+                         : Json::StyledWriter().write(e));
+    buffer->close();
+    log_sampled(url, "lasted",
+                std::chrono::duration<double>(std::chrono::system_clock::now() -
+                                              start_time)
+                    .count());
+  });
+  return response;
+}
 
+IHttpServer::IResponse::Pointer HttpServer::ConnectionCallback::json_response(
+    const IHttpServer::IRequest& c, const Json::Value& result) const {
+  const auto& config = server_->config_;
+  auto encoding = config.compression_level_ > 0
+                      ? negotiate_encoding(c.header("Accept-Encoding"))
+                      : Encoding::Identity;
   auto str = Json::StyledWriter().write(result);
-  return response_from_string(c, 200, {{"Content-Type", "application/json"}},
-                              str);
+  IHttpServer::IResponse::Headers headers = {
+      {"Content-Type", "application/json"}};
+  if (encoding != Encoding::Identity &&
+      str.size() >= config.compression_min_size_) {
+    headers["Content-Encoding"] = encoding_name(encoding);
+    headers["Vary"] = "Accept-Encoding";
+    str = compress(encoding, config.compression_level_, str);
+  }
+  return response_from_string(c, 200, headers, str);
 }
 
-HttpServer::HttpServer(Json::Value config)
+HttpServer::HttpServer(Json::Value config, WorkerStatus* status)
     : done_(),
       clean_up_thread_([=]() {
         while (!done_) {
@@ -202,7 +885,7 @@ HttpServer::HttpServer(Json::Value config)
           pending_requests_condition_.wait(
               lock, [=]() { return !pending_requests_.empty() || done_; });
           while (!pending_requests_.empty()) {
-            auto r = pending_requests_.back();
+            auto r = std::move(pending_requests_.back());
             pending_requests_.pop_back();
             lock.unlock();
             r.request_->finish();
@@ -214,13 +897,33 @@ HttpServer::HttpServer(Json::Value config)
       request_id_(),
       server_port_(config["port"].asInt()),
       server_factory_(std::make_unique<MicroHttpdServerFactory>()),
-      main_server_(DispatchServer(server_factory_.get(), server_port_,
+      main_server_(DispatchServer(server_factory(server_factory_.get(), status),
+                                  server_port_,
                                   std::bind(&HttpServer::proxy, this, _1, _2))),
       query_server_(main_server_, "",
                     std::make_unique<ConnectionCallback>(this)),
       config_(config),
-      http_(std::make_shared<curl::CurlHttp>()) {
+      rate_limiter_(config["rate_limit"]),
+      http_(make_http(config, status)),
+      file_cache_(config_.file_cache_size_ > 0
+                      ? std::make_shared<RangeCache>(http_,
+                                                     config_.file_cache_size_)
+                      : nullptr),
+      provider_http_(file_cache_ ? file_cache_ : http_),
+      status_(status) {
   av_log_set_level(AV_LOG_PANIC);
+  ::util::log_configure(config);
+  ::util::scheduler_configure(config);
+  ::util::memory_configure(config);
+  if (!config_.temporary_directory_.empty() && config_.store_size_ > 0) {
+    try {
+      store_ = std::make_unique<Store>(
+          config_.temporary_directory_ + "/cloudstorage-server",
+          config_.store_size_);
+    } catch (const std::exception& e) {
+      log(LogLevel::Error, "couldn't open store:", e.what());
+    }
+  }
 }
 
 HttpServer::~HttpServer() {
@@ -232,11 +935,15 @@ HttpServer::~HttpServer() {
 IHttpServer::IResponse::Pointer HttpServer::proxy(
     const IHttpServer::IRequest& request,
     const DispatchServer::Callback& callback) {
-  if (request.url() == "/files") {
+  std::string buffer;
+  if (strcmp(request_path(request, &buffer), "/files") == 0) {
     auto provider = request.get("provider");
     auto file = request.get("file");
     if (!provider || !file)
       return response_from_string(request, IHttpRequest::Bad, {}, "");
+    if (!::util::memory_admit(Priority::Interactive))
+      return response_from_string(request, IHttpRequest::ServiceUnavailable,
+                                  {{"Retry-After", "1"}}, "");
     HttpCloudProvider c(config_);
     auto provider_object = c.provider(this, request);
     if (!provider_object) return nullptr;
@@ -271,8 +978,10 @@ HttpServer::AuthCallback::userConsentRequired(const ICloudProvider& p) {
 
 void HttpServer::AuthCallback::done(const ICloudProvider& p,
                                     EitherError<void> e) {
+  if (!e.left()) server_->tokens_.update(key_, p);
   if (e.left())
-    log("auth error", e.left()->code_, e.left()->description_);
+    log(LogLevel::Warning, "auth error", e.left()->code_,
+        e.left()->description_);
   else
     log("accepted", p.name(), p.token());
 }
@@ -285,18 +994,28 @@ std::shared_ptr<ICloudProvider> HttpCloudProvider::provider(
   if (!provider || !token) return nullptr;
   auto hints = config_.hints(provider);
   if (!hints) return nullptr;
-  if (access_token) (*hints)["access_token"] = access_token;
-  (*hints)["state"] =
-      provider + SEPARATOR + std::to_string(server->request_id_++);
-  ICloudProvider::InitData data;
-  data.permission_ = ICloudProvider::Permission::Read;
-  data.token_ = token;
-  data.http_server_ =
-      std::make_unique<ServerWrapperFactory>(server->main_server_);
-  data.http_engine_ = std::make_unique<HttpWrapper>(server->http_);
-  data.hints_ = *hints;
-  data.callback_ = std::make_unique<HttpServer::AuthCallback>(this);
-  return ICloudStorage::create()->provider(provider, std::move(data));
+  ICloudProvider::Hints base = *hints;
+  auto create = [=](const TokenStore::Session* session) {
+    auto h = base;
+    if (access_token) h["access_token"] = access_token;
+    if (session) h["access_token"] = session->access_token_;
+    h["state"] = provider + SEPARATOR + std::to_string(server->request_id_++);
+    ICloudProvider::InitData data;
+    data.permission_ = ICloudProvider::Permission::Read;
+    data.token_ = session ? session->token_ : token;
+    data.http_server_ =
+        std::make_unique<ServerWrapperFactory>(server->main_server_);
+    data.http_engine_ = std::make_unique<HttpWrapper>(
+        server->provider_http_, &server->rate_limiter_,
+        server->rate_limiter_.bucket(provider, token));
+    data.hints_ = h;
+    data.callback_ = std::make_unique<HttpServer::AuthCallback>(
+        server, provider + SEPARATOR + token);
+    return std::shared_ptr<ICloudProvider>(
+        ICloudStorage::create()->provider(provider, std::move(data)));
+  };
+  if (token == ""s) return create(nullptr);
+  return server->tokens_.provider(provider + SEPARATOR + token, create);
 }
 
 void HttpCloudProvider::exchange_code(std::shared_ptr<ICloudProvider> p,
@@ -325,25 +1044,37 @@ void HttpCloudProvider::list_directory(std::shared_ptr<ICloudProvider> p,
                                        const char* page_token, Completed c) {
   if (!page_token)
     return c(error(p, Error{IHttpRequest::Bad, "missing page token"}));
+  auto store = config_.listing_max_age_ != std::chrono::seconds::zero()
+                   ? server->store_.get()
+                   : nullptr;
+  auto key = item_id ? listing_key(p, item_id, page_token) : "";
+  auto respond = [=](const std::string& listing) {
+    Json::Value content;
+    if (!Json::Reader().parse(listing, content)) return false;
+    Json::Value result = session(p);
+    result["items"] = content["items"];
+    if (content.isMember("next_token"))
+      result["next_token"] = content["next_token"];
+    c(result);
+    return true;
+  };
+  if (store && item_id)
+    if (auto data = store->get(key, config_.listing_max_age_))
+      if (respond(*data)) return;
   item(p, server, item_id, [=](auto item) {
     if (item.left()) return c(error(p, *item.left()));
     server->add(
         p, p->listDirectoryPageAsync(item.right(), page_token, [=](auto list) {
           if (list.right()) {
-            Json::Value result = session(p);
+            Json::Value content;
             Json::Value array(Json::arrayValue);
-            auto lst = list.right()->items_;
-            for (auto i : lst) {
-              Json::Value v;
-              v["id"] = i->id();
-              v["filename"] = i->filename();
-              v["type"] = file_type_to_string(i->type());
-              array.append(v);
-            }
-            result["items"] = array;
+            for (auto i : list.right()->items_) array.append(item_to_json(i));
+            content["items"] = array;
             if (!list.right()->next_token_.empty())
-              result["next_token"] = list.right()->next_token_;
-            c(result);
+              content["next_token"] = list.right()->next_token_;
+            auto listing = Json::FastWriter().write(content);
+            if (store) store->put(key, listing);
+            respond(listing);
           } else {
             c(error(p, *list.left()));
           }
@@ -351,6 +1082,41 @@ void HttpCloudProvider::list_directory(std::shared_ptr<ICloudProvider> p,
   });
 }
 
+void HttpCloudProvider::list_directory_all(std::shared_ptr<ICloudProvider> p,
+                                           HttpServer* server,
+                                           const char* item_id,
+                                           const char* limit,
+                                           ResponseBuffer::Pointer buffer,
+                                           Completed c) {
+  size_t max_count = limit ? std::strtoull(limit, nullptr, 10) : 0;
+  if (max_count == 0) max_count = std::numeric_limits<size_t>::max();
+  item(p, server, item_id, [=](auto item) {
+    if (item.left()) return c(error(p, *item.left()));
+    std::make_shared<DirectoryStream>(p, server, item.right(), max_count,
+                                      buffer, c)
+        ->fetch("", 0);
+  });
+}
+
+void HttpCloudProvider::tree(std::shared_ptr<ICloudProvider> p,
+                             HttpServer* server, const char* item_id,
+                             const char* depth, const char* limit,
+                             ResponseBuffer::Pointer buffer, Completed c) {
+  auto max_depth = config_.tree_max_depth_;
+  if (depth) max_depth = std::max(1, std::min(max_depth, std::atoi(depth)));
+  size_t max_count = limit ? std::strtoull(limit, nullptr, 10) : 0;
+  if (max_count == 0) max_count = std::numeric_limits<size_t>::max();
+  auto parallelism = config_.tree_parallelism_;
+  item(p, server, item_id, [=](auto item) {
+    if (item.left()) return c(error(p, *item.left()));
+    if (item.right()->type() != IItem::FileType::Directory)
+      return c(error(p, Error{IHttpRequest::Bad, "not a directory"}));
+    std::make_shared<TreeWalker>(p, server, parallelism, max_depth, max_count,
+                                 buffer, c)
+        ->start(item.right());
+  });
+}
+
 void HttpCloudProvider::get_item_data(std::shared_ptr<ICloudProvider> p,
                                       HttpServer* server, const char* item_id,
                                       Completed c) {
@@ -369,30 +1135,137 @@ void HttpCloudProvider::get_item_data(std::shared_ptr<ICloudProvider> p,
   });
 }
 
+IItem::Pointer HttpCloudProvider::cached_item(std::shared_ptr<ICloudProvider> p,
+                                              HttpServer* server,
+                                              const char* item_id) {
+  if (!item_id) return nullptr;
+  if (item_id == "root"s) return p->rootDirectory();
+  auto store = server->store_.get();
+  if (!store) return nullptr;
+  if (auto data = store->get(store_key(p, "item", item_id),
+                             config_.metadata_max_age_)) {
+    try {
+      return Item::fromString(*data);
+    } catch (const std::exception&) {
+    }
+  }
+  return nullptr;
+}
+
+std::string HttpCloudProvider::cached_etag(std::shared_ptr<ICloudProvider> p,
+                                           HttpServer* server,
+                                           const IHttpServer::IRequest& r,
+                                           Cached cached) {
+  auto store = server->store_.get();
+  if (!store) return "";
+  auto item_id = r.get("item_id");
+  if (cached == Cached::Thumbnail) {
+    if (auto i = cached_item(p, server, item_id))
+      return item_etag(
+          i, "thumbnail" + std::to_string(thumbnail_variant(r.get("size"))));
+  } else if (cached == Cached::Sprite) {
+    if (auto i = cached_item(p, server, item_id))
+      return item_etag(
+          i, "sprite" + std::to_string(sprite_frame_count(r.get("count"))));
+  } else if (cached == Cached::Listing) {
+    auto page_token = r.get("page_token");
+    if (!item_id || !page_token ||
+        config_.listing_max_age_ == std::chrono::seconds::zero())
+      return "";
+    // The body carries the session next to the listing.
+    if (auto data = store->get(listing_key(p, item_id, page_token),
+                               config_.listing_max_age_))
+      return make_etag(*data + Json::FastWriter().write(session(p)));
+  }
+  return "";
+}
+
 void HttpCloudProvider::item(std::shared_ptr<ICloudProvider> p,
                              HttpServer* server, const char* item_id,
                              CompletedItem c) {
-  if (!item_id)
-    c(Error{IHttpRequest::NotFound, "not found"});
-  else
-    item_id == "root"s ? c(p->rootDirectory())
-                       : server->add(p, p->getItemDataAsync(item_id, c));
+  if (!item_id) return c(Error{IHttpRequest::NotFound, "not found"});
+  if (auto i = cached_item(p, server, item_id)) {
+    trace_mark("item cached");
+    return c(i);
+  }
+  auto store = server->store_.get();
+  auto key = store_key(p, "item", item_id);
+  server->add(p, p->getItemDataAsync(item_id, [=](EitherError<IItem> e) {
+    trace_mark("item fetched");
+    if (store && e.right()) store->put(key, e.right()->toString());
+    c(e);
+  }));
 }
 
 void HttpCloudProvider::thumbnail(std::shared_ptr<ICloudProvider> p,
                                   HttpServer* server, const char* item_id,
-                                  Completed c) {
+                                  const char* size, Completed c) {
+  auto variant = thumbnail_variant(size);
   item(p, server, item_id, [=](auto item) {
     if (item.left()) return c(error(p, *item.left()));
+    auto i = item.right();
+    auto store = server->store_.get();
+    auto key = thumbnail_key(p, i, variant);
+    auto respond = [=](const ChunkBuffer& data) {
+      // The body is tagged by the item's version alone, so it carries no
+      // session.
+      Json::Value result;
+      result["provider"] = p->name();
+      result["thumbnail"] = to_base64(data);
+      c(result);
+    };
+    if (store) {
+      if (auto data = store->get(key))
+        return respond(ChunkBuffer(std::move(*data)));
+    }
+    // All variants come out of a single decode of the original thumbnail and
+    // are stored together.
+    auto resize = [=](ChunkBuffer original) {
+      if (variant == 0) return respond(original);
+      enqueue(tenant(p), [=]() {
+        // The decoder reads from contiguous memory.
+        auto variants = cloudstorage::generate_thumbnail_variants(
+            original.to_string(), THUMBNAIL_VARIANTS);
+        if (variants.left()) {
+          log(LogLevel::Warning, "couldn't resize thumbnail:",
+              variants.left()->description_);
+          return respond(original);
+        }
+        std::string result;
+        for (size_t v = 0; v < THUMBNAIL_VARIANTS.size(); v++) {
+          auto& data = (*variants.right())[v];
+          if (store)
+            store->put(thumbnail_key(p, i, THUMBNAIL_VARIANTS[v]), data);
+          if (THUMBNAIL_VARIANTS[v] == variant) result = std::move(data);
+        }
+        respond(ChunkBuffer(std::move(result)));
+      });
+    };
+    auto original_key = thumbnail_key(p, i);
+    if (store && variant != 0) {
+      if (auto data = store->get(original_key))
+        return resize(ChunkBuffer(std::move(*data)));
+    }
+    auto f = [=](ChunkBuffer data) {
+      if (store) store->put(original_key, data);
+      resize(std::move(data));
+    };
 
     class download : public IDownloadFileCallback {
      public:
       download(EitherError<IItem> item, std::shared_ptr<ICloudProvider> p,
-               bool secure, uint16_t port, Completed c)
-          : item_(item), p_(p), secure_(secure), port_(port), c_(c) {}
+               bool secure, uint16_t port,
+               std::function<void(ChunkBuffer)> f, Completed c)
+          : item_(item),
+            p_(p),
+            secure_(secure),
+            port_(port),
+            f_(f),
+            c_(c) {}
 
       void receivedData(const char* data, uint32_t length) override {
-        for (size_t i = 0; i < length; i++) data_.push_back(data[i]);
+        data_.append(data, length);
+        charge_.add(length);
       }
       void done(EitherError<void> thumbnail) override {
         auto i = item_.right();
@@ -400,43 +1273,29 @@ void HttpCloudProvider::thumbnail(std::shared_ptr<ICloudProvider> p,
         auto p = std::move(p_);
         auto secure = secure_;
         auto port = port_;
-        auto f = [=](const std::vector<char>& data) {
-          Json::Value result = session(p);
-          result["thumbnail"] =
-              to_base64(std::string(data.begin(), data.end()));
-          c(result);
-        };
+        auto f = std::move(f_);
         if (thumbnail.left()) {
-          enqueue([=]() {
+          enqueue(tenant(p), [=]() {
             auto url_result = p->getItemUrlAsync(i)->result();
             if (!url_result.right())
               return c(error(
                   p, Error{IHttpRequest::Bad, "couldn't generate thumbnail"s}));
-            auto url = *url_result.right();
+            auto url = local_url(p, *url_result.right(), secure, port);
             try {
-              auto file_url = p->hints()["file_url"];
-              if (!file_url.empty() && url.length() >= file_url.length()) {
-                if (url.substr(0, file_url.length()) == file_url) {
-                  auto rest =
-                      std::string(url.begin() + file_url.length(), url.end());
-                  url = (secure ? "https" : "http") + "://127.0.0.1:"s +
-                        std::to_string(port) + rest;
-                }
-              }
               auto buffer = cloudstorage::generate_thumbnail(
                   url, [](auto) { return false; });
               if (buffer.left()) {
                 throw std::logic_error(buffer.left()->description_);
               }
-              auto ptr = reinterpret_cast<const char*>(buffer.right()->data());
-              f(std::vector<char>(ptr, ptr + buffer.right()->size()));
+              f(ChunkBuffer(std::move(*buffer.right())));
             } catch (const std::exception& e) {
-              log("couldn't generate thumbnail:", e.what());
+              log(LogLevel::Warning, "couldn't generate thumbnail:",
+                  e.what());
               c(error(p, Error{IHttpRequest::Bad, e.what()}));
             }
           });
         } else {
-          f(data_);
+          f(std::move(data_));
         }
       }
       void progress(uint64_t, uint64_t) override {}
@@ -445,14 +1304,75 @@ void HttpCloudProvider::thumbnail(std::shared_ptr<ICloudProvider> p,
       std::shared_ptr<ICloudProvider> p_;
       bool secure_;
       uint16_t port_;
+      std::function<void(ChunkBuffer)> f_;
       Completed c_;
-      std::vector<char> data_;
+      ChunkBuffer data_;
+      ::util::MemoryCharge charge_{::util::MemoryCategory::Download};
     };
 
-    server->add(p, p->getThumbnailAsync(item.right(),
-                                        std::make_shared<download>(
-                                            item, p, server->config_.secure_,
-                                            server->server_port_, c)));
+    server->add(p,
+                p->getThumbnailAsync(
+                    i, std::make_shared<download>(item, p,
+                                                  server->config_.secure_,
+                                                  server->server_port_, f, c)));
+  });
+}
+
+void HttpCloudProvider::thumbnail_sprite(std::shared_ptr<ICloudProvider> p,
+                                         HttpServer* server,
+                                         const char* item_id,
+                                         const char* count, Completed c) {
+  auto frame_count = sprite_frame_count(count);
+  item(p, server, item_id, [=](auto item) {
+    if (item.left()) return c(error(p, *item.left()));
+    auto i = item.right();
+    if (i->type() != IItem::FileType::Video)
+      return c(error(p, Error{IHttpRequest::Bad, "not a video"}));
+    auto store = server->store_.get();
+    auto key = sprite_key(p, i, frame_count);
+    auto respond = [=](const std::string& sprite) {
+      Json::Value content;
+      if (!Json::Reader().parse(sprite, content)) return false;
+      // Tagged by the item's version like thumbnails, without the session.
+      Json::Value result;
+      result["provider"] = p->name();
+      for (auto name : content.getMemberNames()) result[name] = content[name];
+      c(result);
+      return true;
+    };
+    if (store)
+      if (auto data = store->get(key))
+        if (respond(*data)) return;
+    auto secure = server->config_.secure_;
+    auto port = server->server_port_;
+    enqueue(tenant(p), [=]() {
+      auto url_result = p->getItemUrlAsync(i)->result();
+      if (!url_result.right())
+        return c(error(p, Error{IHttpRequest::Bad, "couldn't get item url"}));
+      auto sprite = cloudstorage::generate_sprite(
+          local_url(p, *url_result.right(), secure, port), frame_count,
+          SPRITE_TILE_SIZE, [](auto) { return false; });
+      if (sprite.left()) {
+        log(LogLevel::Warning, "couldn't generate sprite:",
+            sprite.left()->description_);
+        return c(
+            error(p, Error{IHttpRequest::Bad, sprite.left()->description_}));
+      }
+      Json::Value content;
+      content["sprite"] =
+          to_base64(ChunkBuffer(std::move(sprite.right()->image_)));
+      content["columns"] = sprite.right()->columns_;
+      content["rows"] = sprite.right()->rows_;
+      content["tile_width"] = sprite.right()->tile_width_;
+      content["tile_height"] = sprite.right()->tile_height_;
+      Json::Value timestamps(Json::arrayValue);
+      for (auto t : sprite.right()->timestamps_)
+        timestamps.append(Json::Int64(t));
+      content["timestamps"] = timestamps;
+      auto data = Json::FastWriter().write(content);
+      if (store) store->put(key, data);
+      respond(data);
+    });
   });
 }
 
@@ -465,6 +1385,39 @@ Json::Value HttpCloudProvider::error(std::shared_ptr<ICloudProvider> p,
   return result;
 }
 
+IHttpServer::IResponse::Pointer HttpServer::thumbnail_jobs(
+    const IHttpServer::IRequest& request) {
+  std::vector<std::string> ids;
+  std::stringstream stream(request.get("ids") ? request.get("ids") : "");
+  std::string id;
+  while (std::getline(stream, id, ',') && ids.size() < MAX_POLLED_JOBS)
+    if (!id.empty()) ids.push_back(id);
+  auto wait = request.get("wait")
+                  ? std::max(0, std::min(MAX_JOB_WAIT,
+                                         std::atoi(request.get("wait"))))
+                  : 0;
+  IHttpServer::IResponse::Headers headers = {
+      {"Content-Type", "application/json"}};
+  if (wait == 0) {
+    Json::Value result;
+    jobs_.poll(ids, std::chrono::milliseconds::zero(),
+               [&](Json::Value e) { result = e; });
+    return response_from_string(request, IHttpRequest::Ok, headers,
+                                Json::StyledWriter().write(result));
+  }
+  auto buffer = std::make_shared<ResponseBuffer>();
+  auto response = request.response(
+      IHttpRequest::Ok, headers, IHttpServer::IResponse::UnknownSize,
+      std::make_unique<ResponseCallback>(buffer));
+  buffer->attach(response.get());
+  response->completed([=]() { buffer->detach(); });
+  jobs_.poll(ids, std::chrono::seconds(wait), [=](Json::Value e) {
+    buffer->write(Json::StyledWriter().write(e));
+    buffer->close();
+  });
+  return response;
+}
+
 Json::Value HttpServer::list_providers(const IHttpServer::IRequest&) const {
   Json::Value result;
   Json::Value array(Json::arrayValue);
@@ -487,8 +1440,93 @@ Json::Value HttpServer::list_providers(const IHttpServer::IRequest&) const {
   return result;
 }
 
+Json::Value HttpServer::metrics() const {
+  auto result = process_metrics();
+  if (status_) {
+    result["worker"] = status_->index();
+    result["group"] = status_->collect();
+  }
+  return result;
+}
+
+Json::Value HttpServer::process_metrics() const {
+  Json::Value result;
+  result["sessions"] = Json::UInt64(tokens_.size());
+  result["callbacks"] = Json::UInt64(main_server_.callback_count());
+  {
+    std::lock_guard<std::mutex> lock(pending_requests_mutex_);
+    result["pending_requests"] = Json::UInt64(pending_requests_.size());
+  }
+  auto usage = ::util::resource_usage();
+  result["process"]["rss"] = Json::UInt64(usage.rss_);
+  result["process"]["fds"] = Json::UInt64(usage.fds_);
+  result["process"]["threads"] = Json::UInt64(usage.threads_);
+  auto engine = http_;
+  if (auto recording = std::dynamic_pointer_cast<RecordingHttp>(http_)) {
+    auto stats = recording->stats();
+    result["http_recording"]["recorded"] = Json::UInt64(stats.recorded_);
+    result["http_recording"]["bytes"] = Json::UInt64(stats.bytes_);
+    engine = recording->http();
+  }
+  if (auto replay = std::dynamic_pointer_cast<ReplayHttp>(http_)) {
+    auto stats = replay->stats();
+    result["http_replay"]["exchanges"] = Json::UInt64(stats.exchanges_);
+    result["http_replay"]["replayed"] = Json::UInt64(stats.replayed_);
+    result["http_replay"]["missing"] = Json::UInt64(stats.missing_);
+  }
+  if (auto http = std::dynamic_pointer_cast<CurlMultiHttp>(engine)) {
+    auto stats = http->stats();
+    result["http"]["requests"] = Json::UInt64(stats.requests_);
+    result["http"]["reused_connections"] = Json::UInt64(stats.reused_);
+    result["http"]["failed"] = Json::UInt64(stats.failed_);
+    result["http"]["active"] = Json::UInt64(stats.active_);
+    result["http"]["reuse_ratio"] =
+        stats.requests_ ? double(stats.reused_) / stats.requests_ : 0.0;
+  }
+  if (file_cache_) {
+    auto stats = file_cache_->stats();
+    result["file_cache"]["hits"] = Json::UInt64(stats.hits_);
+    result["file_cache"]["misses"] = Json::UInt64(stats.misses_);
+    result["file_cache"]["coalesced"] = Json::UInt64(stats.coalesced_);
+    result["file_cache"]["prefetched"] = Json::UInt64(stats.prefetched_);
+    result["file_cache"]["tail_prefetched"] = Json::UInt64(stats.tails_);
+    result["file_cache"]["invalidated"] = Json::UInt64(stats.invalidated_);
+    result["file_cache"]["uncached"] = Json::UInt64(stats.uncached_);
+    result["file_cache"]["size"] = Json::UInt64(stats.size_);
+  }
+  auto scheduler = ::util::scheduler_stats();
+  result["scheduler"]["queued"] = Json::UInt64(scheduler.queued_);
+  result["scheduler"]["running"] = Json::UInt64(scheduler.running_);
+  result["scheduler"]["promoted"] = Json::UInt64(scheduler.promoted_);
+  result["rate_limit"] = rate_limiter_.stats();
+  auto jobs = jobs_.stats();
+  result["jobs"]["running"] = Json::UInt64(jobs.running_);
+  result["jobs"]["finished"] = Json::UInt64(jobs.finished_);
+  result["jobs"]["deduplicated"] = Json::UInt64(jobs.deduplicated_);
+  result["jobs"]["timed_out"] = Json::UInt64(jobs.timed_out_);
+  result["jobs"]["waiters"] = Json::UInt64(jobs.waiters_);
+  auto memory = ::util::memory_stats();
+  const char* categories[] = {"response", "download", "thumbnail",
+                              "file_cache"};
+  uint64_t used = 0;
+  for (int i = 0; i < ::util::MEMORY_CATEGORY_COUNT; i++) {
+    result["memory"][categories[i]] = Json::UInt64(memory.used_[i]);
+    used += memory.used_[i];
+  }
+  result["memory"]["used"] = Json::UInt64(used);
+  result["memory"]["limit"] = Json::UInt64(memory.limit_);
+  result["memory"]["rejected"] = Json::UInt64(memory.rejected_);
+  auto log = ::util::log_stats();
+  result["log"]["written"] = Json::UInt64(log.written_);
+  result["log"]["dropped"] = Json::UInt64(log.dropped_);
+  result["log"]["truncated"] = Json::UInt64(log.truncated_);
+  result["log"]["sampled_out"] = Json::UInt64(log.sampled_out_);
+  return result;
+}
+
 void HttpServer::add(std::shared_ptr<ICloudProvider> p,
                      std::shared_ptr<IGenericRequest> r) {
+  trace_mark("provider request");
   {
     std::lock_guard<std::mutex> lock(pending_requests_mutex_);
     pending_requests_.push_back({p, r});
@@ -496,4 +1534,12 @@ void HttpServer::add(std::shared_ptr<ICloudProvider> p,
   pending_requests_condition_.notify_one();
 }
 
-int HttpServer::exec() { return semaphore_.get_future().get(); }
+int HttpServer::exec() {
+  auto future = semaphore_.get_future();
+  if (status_) {
+    do {
+      status_->publish(process_metrics());
+    } while (future.wait_for(STATUS_INTERVAL) != std::future_status::ready);
+  }
+  return future.get();
+}
@@ -11,6 +11,14 @@
 #include <thread>
 
 #include "DispatchServer.h"
+#include "JobRegistry.h"
+#include "RangeCache.h"
+#include "RateLimiter.h"
+#include "ResponseBuffer.h"
+#include "Store.h"
+#include "Supervisor.h"
+#include "TokenStore.h"
+#include "Trace.h"
 #include "Utility.h"
 
 using namespace cloudstorage;
@@ -29,6 +37,16 @@ struct CloudConfig {
   std::string temporary_directory_;
   Json::Value keys_;
   bool secure_;
+  uint64_t store_size_;
+  uint64_t file_cache_size_;
+  std::chrono::seconds metadata_max_age_;
+  std::chrono::seconds listing_max_age_;
+  int compression_level_;
+  // Only applies to responses built in one piece; streamed provider
+  // responses commit to an encoding before any of their body exists.
+  size_t compression_min_size_;
+  int tree_parallelism_;
+  int tree_max_depth_;
 };
 
 class HttpCloudProvider {
@@ -45,17 +63,43 @@ class HttpCloudProvider {
   void item(std::shared_ptr<ICloudProvider> p, HttpServer* server,
             const char* item_id, CompletedItem);
 
+  IItem::Pointer cached_item(std::shared_ptr<ICloudProvider> p,
+                             HttpServer* server, const char* item_id);
+
+  // Responses whose ETag cached_etag can derive from the store.
+  enum class Cached { None, Listing, Thumbnail, Sprite };
+
+  // Returns the ETag of the |cached| response the request would produce when
+  // it is known without contacting the provider, otherwise an empty string.
+  std::string cached_etag(std::shared_ptr<ICloudProvider> p,
+                          HttpServer* server, const IHttpServer::IRequest&,
+                          Cached cached);
+
   void exchange_code(std::shared_ptr<ICloudProvider> p, HttpServer* server,
                      const char* code, Completed);
 
   void list_directory(std::shared_ptr<ICloudProvider> p, HttpServer* server,
                       const char* item_id, const char* page_token, Completed);
 
+  void list_directory_all(std::shared_ptr<ICloudProvider> p,
+                          HttpServer* server, const char* item_id,
+                          const char* limit, ResponseBuffer::Pointer,
+                          Completed);
+
+  // Streams the entries of all folders below |item_id|, down to |depth|
+  // levels, as newline delimited json.
+  void tree(std::shared_ptr<ICloudProvider> p, HttpServer* server,
+            const char* item_id, const char* depth, const char* limit,
+            ResponseBuffer::Pointer, Completed);
+
   void get_item_data(std::shared_ptr<ICloudProvider> p, HttpServer* server,
                      const char* item_id, Completed);
 
   void thumbnail(std::shared_ptr<ICloudProvider> p, HttpServer* server,
-                 const char* item_id, Completed);
+                 const char* item_id, const char* size, Completed);
+
+  void thumbnail_sprite(std::shared_ptr<ICloudProvider> p, HttpServer* server,
+                        const char* item_id, const char* count, Completed);
 
   static Json::Value error(std::shared_ptr<ICloudProvider> p, Error);
 
@@ -67,13 +111,15 @@ class HttpServer {
  public:
   class AuthCallback : public ICloudProvider::IAuthCallback {
    public:
-    AuthCallback(HttpCloudProvider* data) : data_(data) {}
+    AuthCallback(HttpServer* server, std::string key)
+        : server_(server), key_(key) {}
 
     Status userConsentRequired(const ICloudProvider& p) override;
     void done(const ICloudProvider&, EitherError<void>) override;
 
    private:
-    HttpCloudProvider* data_;
+    HttpServer* server_;
+    std::string key_;
   };
 
   class ConnectionCallback : public IHttpServer::ICallback {
@@ -84,10 +130,20 @@ class HttpServer {
         const IHttpServer::IRequest&) override;
 
    private:
+    struct Route;
+
+    // Returns the entry of the route table for |path|, or null.
+    static const Route* route(const char* path);
+
+    IHttpServer::IResponse::Pointer provider_request(
+        const IHttpServer::IRequest&, const std::string& url, const Route&);
+    IHttpServer::IResponse::Pointer json_response(
+        const IHttpServer::IRequest&, const Json::Value&) const;
+
     HttpServer* server_;
   };
 
-  HttpServer(Json::Value config);
+  HttpServer(Json::Value config, WorkerStatus* status = nullptr);
   ~HttpServer();
 
   IHttpServer::IResponse::Pointer proxy(const IHttpServer::IRequest&,
@@ -95,6 +151,12 @@ class HttpServer {
 
   Json::Value list_providers(const IHttpServer::IRequest&) const;
 
+  // Long-polls the thumbnail jobs listed in "ids" for up to "wait" seconds.
+  IHttpServer::IResponse::Pointer thumbnail_jobs(const IHttpServer::IRequest&);
+
+  Json::Value metrics() const;
+  Json::Value process_metrics() const;
+
   void add(std::shared_ptr<ICloudProvider> p, std::shared_ptr<IGenericRequest>);
 
   int exec();
@@ -107,7 +169,7 @@ class HttpServer {
     std::shared_ptr<IGenericRequest> request_;
   };
 
-  std::mutex pending_requests_mutex_;
+  mutable std::mutex pending_requests_mutex_;
   std::condition_variable pending_requests_condition_;
   std::vector<Request> pending_requests_;
   std::atomic_bool done_;
@@ -118,7 +180,15 @@ class HttpServer {
   DispatchServer main_server_;
   ServerWrapper query_server_;
   CloudConfig config_;
+  RateLimiter rate_limiter_;
   std::shared_ptr<IHttp> http_;
+  std::shared_ptr<RangeCache> file_cache_;
+  std::shared_ptr<IHttp> provider_http_;
+  std::unique_ptr<Store> store_;
+  TokenStore tokens_;
+  WorkerStatus* status_;
+  FlightRecorder recorder_;
+  JobRegistry jobs_;
   std::promise<int> semaphore_;
   mutable std::mutex lock_;
 };
@@ -0,0 +1,197 @@
+#include "JobRegistry.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+const auto JOB_RETENTION = std::chrono::minutes(5);
+const auto JOB_TIMEOUT = std::chrono::minutes(2);
+const size_t MAX_FINISHED_JOBS = 4096;
+
+namespace {
+
+std::string job_id(const std::string& key) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (unsigned char c : key) {
+    hash ^= c;
+    hash *= 0x100000001b3ULL;
+  }
+  std::stringstream stream;
+  stream << std::hex << std::setw(16) << std::setfill('0') << hash;
+  return stream.str();
+}
+
+}  // namespace
+
+JobRegistry::JobRegistry()
+    : generation_(),
+      deduplicated_(),
+      timed_out_(),
+      done_(),
+      thread_(std::bind(&JobRegistry::run, this)) {}
+
+JobRegistry::~JobRegistry() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    done_ = true;
+  }
+  condition_.notify_one();
+  thread_.join();
+}
+
+std::string JobRegistry::submit(const std::string& key, Start start) {
+  auto id = job_id(key);
+  uint64_t generation;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    prune();
+    auto it = jobs_.find(id);
+    if (it != jobs_.end() &&
+        (!it->second.finished_ || !it->second.result_.isMember("error"))) {
+      deduplicated_++;
+      return id;
+    }
+    generation = ++generation_;
+    jobs_[id] = Job{Json::Value(), false, generation,
+                    std::chrono::steady_clock::now() + JOB_TIMEOUT, {}};
+  }
+  condition_.notify_one();
+  start([=](Json::Value result) { finished(id, generation, result); });
+  return id;
+}
+
+void JobRegistry::poll(const std::vector<std::string>& ids,
+                       std::chrono::milliseconds timeout, Completed callback) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (timeout <= std::chrono::milliseconds::zero() || any_finished(ids)) {
+    auto result = state(ids);
+    lock.unlock();
+    return callback(result);
+  }
+  waiters_.push_back(
+      Waiter{ids, std::chrono::steady_clock::now() + timeout, callback});
+  condition_.notify_one();
+}
+
+JobRegistry::Stats JobRegistry::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Stats result = {};
+  for (const auto& j : jobs_)
+    (j.second.finished_ ? result.finished_ : result.running_)++;
+  result.deduplicated_ = deduplicated_;
+  result.timed_out_ = timed_out_;
+  result.waiters_ = waiters_.size();
+  return result;
+}
+
+void JobRegistry::finished(const std::string& id, uint64_t generation,
+                           Json::Value result) {
+  Ready ready;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = jobs_.find(id);
+    // Late results of timed out jobs are dropped.
+    if (it == jobs_.end() || it->second.finished_ ||
+        it->second.generation_ != generation)
+      return;
+    finish(id, it->second, std::move(result), &ready);
+  }
+  for (const auto& r : ready) r.first(r.second);
+}
+
+void JobRegistry::finish(const std::string& id, Job& job, Json::Value result,
+                         Ready* ready) {
+  job.result_ = std::move(result);
+  job.finished_ = true;
+  job.finish_time_ = std::chrono::steady_clock::now();
+  for (auto it = waiters_.begin(); it != waiters_.end();) {
+    if (std::find(it->ids_.begin(), it->ids_.end(), id) != it->ids_.end()) {
+      ready->emplace_back(std::move(it->callback_), state(it->ids_));
+      it = waiters_.erase(it);
+    } else {
+      it++;
+    }
+  }
+}
+
+Json::Value JobRegistry::state(const std::vector<std::string>& ids) const {
+  Json::Value result(Json::objectValue);
+  for (const auto& id : ids) {
+    Json::Value job;
+    auto it = jobs_.find(id);
+    if (it == jobs_.end()) {
+      job["status"] = "unknown";
+    } else if (!it->second.finished_) {
+      job["status"] = "pending";
+    } else {
+      job["status"] = "done";
+      job["result"] = it->second.result_;
+    }
+    result["jobs"][id] = job;
+  }
+  return result;
+}
+
+bool JobRegistry::any_finished(const std::vector<std::string>& ids) const {
+  return std::any_of(ids.begin(), ids.end(), [=](const std::string& id) {
+    auto it = jobs_.find(id);
+    return it == jobs_.end() || it->second.finished_;
+  });
+}
+
+void JobRegistry::prune() {
+  auto now = std::chrono::steady_clock::now();
+  size_t finished = 0;
+  for (auto it = jobs_.begin(); it != jobs_.end();) {
+    if (it->second.finished_ && now - it->second.finish_time_ > JOB_RETENTION) {
+      it = jobs_.erase(it);
+    } else {
+      finished += it->second.finished_;
+      it++;
+    }
+  }
+  if (finished > MAX_FINISHED_JOBS) {
+    for (auto it = jobs_.begin(); it != jobs_.end();)
+      it = it->second.finished_ ? jobs_.erase(it) : std::next(it);
+  }
+}
+
+void JobRegistry::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    auto now = std::chrono::steady_clock::now();
+    Ready ready;
+    auto next = std::chrono::steady_clock::time_point::max();
+    for (auto& j : jobs_) {
+      if (j.second.finished_) continue;
+      if (j.second.deadline_ <= now) {
+        Json::Value result;
+        result["error"] = "timed out";
+        timed_out_++;
+        finish(j.first, j.second, result, &ready);
+      } else {
+        next = std::min(next, j.second.deadline_);
+      }
+    }
+    for (auto it = waiters_.begin(); it != waiters_.end();) {
+      if (done_ || it->deadline_ <= now) {
+        ready.emplace_back(std::move(it->callback_), state(it->ids_));
+        it = waiters_.erase(it);
+      } else {
+        next = std::min(next, it->deadline_);
+        it++;
+      }
+    }
+    if (!ready.empty()) {
+      lock.unlock();
+      for (const auto& r : ready) r.first(r.second);
+      lock.lock();
+      continue;
+    }
+    if (done_) return;
+    if (next == std::chrono::steady_clock::time_point::max())
+      condition_.wait(lock);
+    else
+      condition_.wait_until(lock, next);
+  }
+}
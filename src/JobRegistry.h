@@ -0,0 +1,85 @@
+#ifndef JOB_REGISTRY_H
+#define JOB_REGISTRY_H
+
+#include <json/json.h>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Background jobs producing a json result, e.g. thumbnails, which clients
+// submit without holding a connection for the whole run and collect later.
+// Jobs are keyed by what they compute, so identical submissions share one.
+// A job not done within a deadline finishes with an error and can be
+// submitted again.
+class JobRegistry {
+ public:
+  using Completed = std::function<void(Json::Value)>;
+  using Start = std::function<void(Completed)>;
+
+  struct Stats {
+    uint64_t running_;
+    uint64_t finished_;
+    uint64_t deduplicated_;
+    uint64_t timed_out_;
+    uint64_t waiters_;
+  };
+
+  JobRegistry();
+  ~JobRegistry();
+
+  // Returns the id of the job computing |key|, calling |start| if there is no
+  // such job running or finished without an error.
+  std::string submit(const std::string& key, Start start);
+
+  // Calls |callback| with the state of jobs |ids| once any of them finished
+  // or |timeout| elapsed.
+  void poll(const std::vector<std::string>& ids,
+            std::chrono::milliseconds timeout, Completed callback);
+
+  Stats stats() const;
+
+ private:
+  struct Job {
+    Json::Value result_;
+    bool finished_;
+    // Tells results of a timed out run apart from those of its resubmission.
+    uint64_t generation_;
+    std::chrono::steady_clock::time_point deadline_;
+    std::chrono::steady_clock::time_point finish_time_;
+  };
+
+  struct Waiter {
+    std::vector<std::string> ids_;
+    std::chrono::steady_clock::time_point deadline_;
+    Completed callback_;
+  };
+
+  using Ready = std::vector<std::pair<Completed, Json::Value>>;
+
+  void finished(const std::string& id, uint64_t generation,
+                Json::Value result);
+  void finish(const std::string& id, Job& job, Json::Value result,
+              Ready* ready);
+  Json::Value state(const std::vector<std::string>& ids) const;
+  bool any_finished(const std::vector<std::string>& ids) const;
+  void prune();
+  void run();
+
+  std::unordered_map<std::string, Job> jobs_;
+  std::list<Waiter> waiters_;
+  uint64_t generation_;
+  uint64_t deduplicated_;
+  uint64_t timed_out_;
+  bool done_;
+  mutable std::mutex mutex_;
+  std::condition_variable condition_;
+  std::thread thread_;
+};
+
+#endif  // JOB_REGISTRY_H
@@ -0,0 +1,67 @@
+#include "MemoryBudget.h"
+
+#include <algorithm>
+#include <atomic>
+
+const uint64_t DEFAULT_MEMORY_LIMIT = 256 << 20;
+const uint64_t INTERACTIVE_HEADROOM = 4;
+
+namespace util {
+
+namespace {
+
+std::atomic<uint64_t> limit(DEFAULT_MEMORY_LIMIT);
+std::atomic<int64_t> total;
+std::atomic<int64_t> used[MEMORY_CATEGORY_COUNT];
+std::atomic<uint64_t> rejected;
+
+}  // namespace
+
+void memory_configure(const Json::Value& config) {
+  if (config.isMember("memory_limit"))
+    limit = config["memory_limit"].asUInt64();
+}
+
+void memory_charge(MemoryCategory category, int64_t bytes) {
+  used[static_cast<int>(category)] += bytes;
+  total += bytes;
+}
+
+bool memory_exceeded() {
+  auto l = limit.load();
+  return l != 0 && total.load() >= static_cast<int64_t>(l);
+}
+
+bool memory_admit(Priority priority) {
+  auto l = limit.load();
+  if (l == 0) return true;
+  if (priority == Priority::Interactive) l += l / INTERACTIVE_HEADROOM;
+  if (total.load() < static_cast<int64_t>(l)) return true;
+  rejected++;
+  return false;
+}
+
+MemoryStats memory_stats() {
+  MemoryStats stats = {};
+  stats.limit_ = limit;
+  for (int i = 0; i < MEMORY_CATEGORY_COUNT; i++)
+    stats.used_[i] = std::max<int64_t>(0, used[i].load());
+  stats.rejected_ = rejected;
+  return stats;
+}
+
+MemoryCharge::MemoryCharge(MemoryCategory category, uint64_t size)
+    : category_(category), size_(size) {
+  if (size_ > 0) memory_charge(category_, size_);
+}
+
+MemoryCharge::~MemoryCharge() {
+  if (size_ > 0) memory_charge(category_, -static_cast<int64_t>(size_));
+}
+
+void MemoryCharge::add(uint64_t size) {
+  size_ += size;
+  memory_charge(category_, size);
+}
+
+}  // namespace util
@@ -0,0 +1,51 @@
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#include <json/json.h>
+#include <cstdint>
+
+#include "Utility.h"
+
+namespace util {
+
+// Buffers on the request path charged against the process-wide budget.
+enum class MemoryCategory { Response, Download, Thumbnail, FileCache };
+
+const int MEMORY_CATEGORY_COUNT = 4;
+
+struct MemoryStats {
+  uint64_t limit_;
+  uint64_t used_[MEMORY_CATEGORY_COUNT];
+  uint64_t rejected_;
+};
+
+void memory_configure(const Json::Value& config);
+void memory_charge(MemoryCategory, int64_t bytes);
+bool memory_exceeded();
+
+// Tells whether new work of |priority| may start. Background classes are
+// turned away once the budget is used up, interactive requests get some
+// headroom above it.
+bool memory_admit(Priority);
+
+MemoryStats memory_stats();
+
+// Keeps |size| bytes charged for as long as it lives.
+class MemoryCharge {
+ public:
+  MemoryCharge(MemoryCategory category, uint64_t size = 0);
+  ~MemoryCharge();
+
+  MemoryCharge(const MemoryCharge&) = delete;
+  MemoryCharge& operator=(const MemoryCharge&) = delete;
+
+  void add(uint64_t size);
+
+ private:
+  MemoryCategory category_;
+  uint64_t size_;
+};
+
+}  // namespace util
+
+#endif  // MEMORY_BUDGET_H
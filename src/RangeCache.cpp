@@ -0,0 +1,691 @@
+#include "RangeCache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "MemoryBudget.h"
+
+using cloudstorage::Error;
+using cloudstorage::EitherError;
+
+const uint64_t CHUNK_SIZE = 1 << 20;
+const uint64_t READ_AHEAD = 2;
+// Chunks fetched from where a trailing mp4 index starts.
+const uint64_t TAIL_READ_AHEAD = 4;
+const size_t MAX_RESOURCES = 4096;
+// Cached chunks are refetched, and with that revalidated against the
+// upstream's validators, once they are this old.
+const std::chrono::seconds CHUNK_MAX_AGE(60);
+// How often a paused reader checks whether it can go on.
+const std::chrono::milliseconds PAUSE_INTERVAL(20);
+
+namespace {
+
+struct Source {
+  std::shared_ptr<IHttp> http_;
+  std::string url_;
+  bool follow_redirect_;
+  IHttpRequest::GetParameters parameters_;
+  IHttpRequest::HeaderParameters headers_;
+  std::string key_;
+};
+
+// Data of a chunk along with the version of the file it came from.
+struct Piece {
+  std::string data_;
+  std::string version_;
+};
+
+bool equals_ignore_case(const std::string& a, const std::string& b) {
+  return a.size() == b.size() &&
+         std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+           return tolower(x) == tolower(y);
+         });
+}
+
+// Parses a single "bytes=begin-[end]" range; suffix and multi ranges aren't
+// cached.
+bool parse_range(const std::string& range, uint64_t* begin, uint64_t* end) {
+  const std::string prefix = "bytes=";
+  if (range.compare(0, prefix.size(), prefix) != 0 ||
+      range.find(',') != std::string::npos)
+    return false;
+  auto dash = range.find('-', prefix.size());
+  if (dash == std::string::npos || dash == prefix.size()) return false;
+  try {
+    *begin = std::stoull(range.substr(prefix.size(), dash - prefix.size()));
+    *end = dash + 1 == range.size() ? UINT64_MAX
+                                    : std::stoull(range.substr(dash + 1));
+  } catch (const std::exception&) {
+    return false;
+  }
+  return *begin <= *end;
+}
+
+uint64_t content_range_total(const IHttpRequest::HeaderParameters& headers) {
+  auto it = headers.find("content-range");
+  if (it == headers.end()) return 0;
+  auto slash = it->second.find('/');
+  if (slash == std::string::npos) return 0;
+  try {
+    return std::stoull(it->second.substr(slash + 1));
+  } catch (const std::exception&) {
+    return 0;
+  }
+}
+
+// Upstream's validator for the content, so that chunks of different versions
+// of a file are never put together.
+std::string content_version(const IHttpRequest::HeaderParameters& headers) {
+  for (auto name : {"etag", "last-modified"}) {
+    auto it = headers.find(name);
+    if (it != headers.end()) return it->second;
+  }
+  return "";
+}
+
+// Fetches chunks only from upstreams answering ranged requests; the transfer
+// is stopped once the upstream turns out to send the whole file instead.
+class RangeCheck : public IHttpRequest::ICallback {
+ public:
+  RangeCheck(std::shared_ptr<std::atomic_bool> ignored) : ignored_(ignored) {}
+
+  bool isSuccess(int code,
+                 const IHttpRequest::HeaderParameters&) const override {
+    if (code == IHttpRequest::Ok) *ignored_ = true;
+    return code == IHttpRequest::Partial;
+  }
+
+  bool abort() override { return *ignored_; }
+
+  bool pause() override { return false; }
+
+  void progressDownload(uint64_t, uint64_t) override {}
+
+  void progressUpload(uint64_t, uint64_t) override {}
+
+ private:
+  std::shared_ptr<std::atomic_bool> ignored_;
+};
+
+uint64_t read_uint(const std::string& data, size_t offset, int bytes) {
+  uint64_t result = 0;
+  for (int i = 0; i < bytes; i++)
+    result = (result << 8) | static_cast<unsigned char>(data[offset + i]);
+  return result;
+}
+
+// Walks the top level boxes of an mp4 / mov file beginning with |head|. When
+// the media data box runs past |head| with no 'moov' box before it, the index
+// sits at the end of the file; returns where it starts, 0 otherwise.
+uint64_t trailing_index_offset(const std::string& head) {
+  static const std::vector<std::string> leading_boxes = {
+      "ftyp", "wide", "free", "skip", "mdat"};
+  if (head.size() < 8 ||
+      std::find(leading_boxes.begin(), leading_boxes.end(),
+                head.substr(4, 4)) == leading_boxes.end())
+    return 0;
+  uint64_t offset = 0;
+  while (offset + 8 <= head.size()) {
+    auto size = read_uint(head, offset, 4);
+    auto type = head.substr(offset + 4, 4);
+    if (size == 1) {
+      if (offset + 16 > head.size()) return 0;
+      size = read_uint(head, offset + 8, 8);
+    }
+    // Size 0 means the box extends to the end of the file.
+    if (size < 8 || type == "moov") return 0;
+    if (type == "mdat") return offset + size > head.size() ? offset + size : 0;
+    offset += size;
+  }
+  return 0;
+}
+
+}  // namespace
+
+class RangeCache::Cache : public std::enable_shared_from_this<Cache> {
+ public:
+  using Callback = std::function<void(EitherError<Piece>)>;
+
+  Cache(uint64_t capacity) : capacity_(capacity), stats_() {}
+
+  ~Cache() {
+    ::util::memory_charge(::util::MemoryCategory::FileCache,
+                          -static_cast<int64_t>(stats_.size_));
+  }
+
+  void get(const Source& source, uint64_t index, Callback callback) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto key = std::make_pair(source.key_, index);
+    auto it = chunks_.find(key);
+    if (it != chunks_.end() && !stale(it)) {
+      if (auto data = it->second.data_) {
+        stats_.hits_++;
+        lru_.splice(lru_.begin(), lru_, it->second.lru_);
+        lock.unlock();
+        return callback(data);
+      }
+      stats_.coalesced_++;
+      it->second.waiters_.push_back(callback);
+      return;
+    }
+    stats_.misses_++;
+    chunks_[key].waiters_.push_back(callback);
+    lock.unlock();
+    fetch(source, index);
+  }
+
+  bool prefetch(const Source& source, uint64_t index) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto& resource = this->resource(source.key_);
+    if (resource.uncached_) return false;
+    auto total = resource.total_;
+    if (total != 0 && index * CHUNK_SIZE >= total) return false;
+    auto key = std::make_pair(source.key_, index);
+    auto it = chunks_.find(key);
+    if (it != chunks_.end() && !stale(it)) return false;
+    stats_.prefetched_++;
+    chunks_[key];
+    lock.unlock();
+    fetch(source, index);
+    return true;
+  }
+
+  uint64_t total(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return resource(key).total_;
+  }
+
+  // Whether the upstream ignored ranged requests for the resource, whose
+  // reads then go past the cache.
+  bool uncached(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return resource(key).uncached_;
+  }
+
+  // Records a read of [begin, end] and tells whether it continues the
+  // previous one.
+  bool access(const std::string& key, uint64_t begin, uint64_t end) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& resource = this->resource(key);
+    bool sequential = resource.next_offset_ != 0 &&
+                      begin >= resource.next_offset_ &&
+                      begin - resource.next_offset_ < CHUNK_SIZE;
+    resource.next_offset_ = end == UINT64_MAX ? 0 : end + 1;
+    return sequential;
+  }
+
+  Stats stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+  }
+
+ private:
+  using ChunkKey = std::pair<std::string, uint64_t>;
+
+  struct Chunk {
+    std::shared_ptr<Piece> data_;
+    std::chrono::steady_clock::time_point fetched_;
+    std::vector<Callback> waiters_;
+    std::list<ChunkKey>::iterator lru_;
+  };
+
+  struct Resource {
+    uint64_t total_ = 0;
+    uint64_t next_offset_ = 0;
+    std::string version_;
+    bool uncached_ = false;
+    std::list<std::string>::iterator lru_;
+  };
+
+  using ChunkIterator = std::map<ChunkKey, Chunk>::iterator;
+
+  // Drops a cached chunk that is due for revalidation, so that the caller
+  // fetches it again.
+  bool stale(ChunkIterator it) {
+    if (!it->second.data_ ||
+        std::chrono::steady_clock::now() - it->second.fetched_ < CHUNK_MAX_AGE)
+      return false;
+    evict(it);
+    return true;
+  }
+
+  void evict(ChunkIterator it) {
+    auto size = it->second.data_->data_.size();
+    stats_.size_ -= size;
+    ::util::memory_charge(::util::MemoryCategory::FileCache,
+                          -static_cast<int64_t>(size));
+    lru_.erase(it->second.lru_);
+    chunks_.erase(it);
+  }
+
+  // Drops the cached chunks of |key| not belonging to |version|; chunks still
+  // being fetched are left to their waiters.
+  void invalidate(const std::string& key, const std::string* version) {
+    auto it = chunks_.lower_bound(std::make_pair(key, 0));
+    while (it != chunks_.end() && it->first.first == key) {
+      auto current = it++;
+      if (current->second.data_ &&
+          (!version || current->second.data_->version_ != *version)) {
+        stats_.invalidated_++;
+        evict(current);
+      }
+    }
+  }
+
+  // Looks up the state of |key|, the least recently used resources are
+  // forgotten along with their chunks.
+  Resource& resource(const std::string& key) {
+    auto it = resources_.find(key);
+    if (it != resources_.end()) {
+      resource_lru_.splice(resource_lru_.begin(), resource_lru_,
+                           it->second.lru_);
+      return it->second;
+    }
+    while (resources_.size() >= MAX_RESOURCES) {
+      auto oldest = resource_lru_.back();
+      invalidate(oldest, nullptr);
+      resources_.erase(oldest);
+      resource_lru_.pop_back();
+    }
+    resource_lru_.push_front(key);
+    auto& resource = resources_[key];
+    resource.lru_ = resource_lru_.begin();
+    return resource;
+  }
+
+  void fetch(const Source& source, uint64_t index) {
+    auto request = source.http_->create(source.url_, "GET",
+                                        source.follow_redirect_);
+    for (const auto& p : source.parameters_)
+      request->setParameter(p.first, p.second);
+    for (const auto& h : source.headers_)
+      request->setHeaderParameter(h.first, h.second);
+    request->setHeaderParameter(
+        "Range", "bytes=" + std::to_string(index * CHUNK_SIZE) + "-" +
+                     std::to_string((index + 1) * CHUNK_SIZE - 1));
+    auto output = std::make_shared<std::stringstream>();
+    auto error = std::make_shared<std::stringstream>();
+    auto ignored = std::make_shared<std::atomic_bool>(false);
+    auto self = shared_from_this();
+    auto key = source.key_;
+    request->send(
+        [=](EitherError<IHttpRequest::Response> e) {
+          // Range was ignored and the whole file is coming back; it isn't
+          // buffered, the readers go straight to the upstream instead.
+          if (*ignored) return self->ignored(key, index);
+          if (e.left()) return self->failed(key, index, *e.left());
+          auto code = e.right()->http_code_;
+          if (code != IHttpRequest::Partial)
+            return self->failed(key, index, Error{code, error->str()});
+          auto total = content_range_total(e.right()->headers_);
+          auto data = output->str();
+          // Demuxers reading such file jump to its end right after the
+          // header; get the index on its way before they ask for it.
+          auto tail = index == 0 ? trailing_index_offset(data) : 0;
+          self->fetched(key, index, total,
+                        content_version(e.right()->headers_),
+                        std::move(data));
+          if (tail != 0 && (total == 0 || tail < total))
+            self->prefetch_tail(source, tail / CHUNK_SIZE);
+        },
+        std::make_shared<std::stringstream>(), output, error,
+        std::make_unique<RangeCheck>(ignored));
+  }
+
+  void prefetch_tail(const Source& source, uint64_t first) {
+    bool started = false;
+    for (auto i = first; i < first + TAIL_READ_AHEAD; i++)
+      started |= prefetch(source, i);
+    if (started) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stats_.tails_++;
+    }
+  }
+
+  void fetched(const std::string& resource, uint64_t index, uint64_t total,
+               const std::string& version, std::string&& data) {
+    auto chunk = std::make_shared<Piece>(Piece{std::move(data), version});
+    std::vector<Callback> waiters;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto& state = this->resource(resource);
+      if (state.version_ != version) {
+        // The file changed upstream, what's cached of it is gone.
+        invalidate(resource, &version);
+        state.version_ = version;
+      }
+      if (total != 0) state.total_ = total;
+      auto key = std::make_pair(resource, index);
+      auto& entry = chunks_[key];
+      if (entry.data_) return;
+      entry.data_ = chunk;
+      entry.fetched_ = std::chrono::steady_clock::now();
+      std::swap(waiters, entry.waiters_);
+      lru_.push_front(key);
+      entry.lru_ = lru_.begin();
+      stats_.size_ += chunk->data_.size();
+      ::util::memory_charge(::util::MemoryCategory::FileCache,
+                            chunk->data_.size());
+      // Under memory pressure the cache gives its space back first.
+      while ((stats_.size_ > capacity_ || ::util::memory_exceeded()) &&
+             lru_.size() > 1)
+        evict(chunks_.find(lru_.back()));
+    }
+    for (const auto& w : waiters) w(chunk);
+  }
+
+  void ignored(const std::string& resource, uint64_t index) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto& state = this->resource(resource);
+      if (!state.uncached_) stats_.uncached_++;
+      state.uncached_ = true;
+    }
+    failed(resource, index,
+           Error{IHttpRequest::Ok, "upstream doesn't support ranges"});
+  }
+
+  void failed(const std::string& resource, uint64_t index, const Error& e) {
+    std::vector<Callback> waiters;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = chunks_.find(std::make_pair(resource, index));
+      if (it == chunks_.end() || it->second.data_) return;
+      std::swap(waiters, it->second.waiters_);
+      chunks_.erase(it);
+    }
+    for (const auto& w : waiters) w(e);
+  }
+
+  uint64_t capacity_;
+  Stats stats_;
+  std::map<ChunkKey, Chunk> chunks_;
+  std::list<ChunkKey> lru_;
+  std::unordered_map<std::string, Resource> resources_;
+  std::list<std::string> resource_lru_;
+  mutable std::mutex mutex_;
+};
+
+// Resumes paused transfers.
+class RangeCache::Timer {
+ public:
+  Timer() : done_(), thread_(std::bind(&Timer::run, this)) {}
+
+  ~Timer() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_ = true;
+    }
+    condition_.notify_one();
+    thread_.join();
+  }
+
+  void schedule(std::chrono::steady_clock::time_point time,
+                std::function<void()> f) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      timers_.emplace(time, std::move(f));
+    }
+    condition_.notify_one();
+  }
+
+ private:
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!done_) {
+      if (timers_.empty()) {
+        condition_.wait(lock);
+        continue;
+      }
+      auto it = timers_.begin();
+      if (it->first > std::chrono::steady_clock::now()) {
+        condition_.wait_until(lock, it->first);
+        continue;
+      }
+      auto f = std::move(it->second);
+      timers_.erase(it);
+      lock.unlock();
+      f();
+      lock.lock();
+    }
+  }
+
+  std::multimap<std::chrono::steady_clock::time_point, std::function<void()>>
+      timers_;
+  bool done_;
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  std::thread thread_;
+};
+
+namespace {
+
+class Transfer : public std::enable_shared_from_this<Transfer> {
+ public:
+  Transfer(std::shared_ptr<RangeCache::Cache> cache,
+           std::weak_ptr<RangeCache::Timer> timer, Source source,
+           uint64_t begin, uint64_t end, IHttpRequest::Pointer upstream,
+           IHttpRequest::CompleteCallback complete,
+           std::shared_ptr<std::istream> data,
+           std::shared_ptr<std::ostream> response,
+           std::shared_ptr<std::ostream> error_stream,
+           IHttpRequest::ICallback::Pointer callback)
+      : cache_(cache),
+        timer_(timer),
+        source_(source),
+        begin_(begin),
+        end_(end),
+        offset_(begin),
+        upstream_(upstream),
+        complete_(complete),
+        data_(data),
+        response_(response),
+        error_stream_(error_stream),
+        callback_(std::move(callback)),
+        sequential_(cache_->access(source_.key_, begin, end)),
+        state_(Waiting) {}
+
+  void next() {
+    while (true) {
+      if (aborted()) return;
+      // The reader can't keep up; neither the next chunk nor read-ahead is
+      // fetched until it can.
+      if (callback_ && callback_->pause()) return wait();
+      if (auto total = cache_->total(source_.key_))
+        end_ = std::min(end_, total - 1);
+      if (offset_ > end_) return finish();
+      auto index = offset_ / CHUNK_SIZE;
+      auto last = end_ == UINT64_MAX ? UINT64_MAX : end_ / CHUNK_SIZE;
+      for (uint64_t i = index + 1; i <= index + READ_AHEAD; i++)
+        if (i <= last || (sequential_ && last != UINT64_MAX))
+          cache_->prefetch(source_, i);
+      state_ = Fetching;
+      auto self = shared_from_this();
+      cache_->get(source_, index,
+                  [=](EitherError<Piece> e) { self->received(e); });
+      if (state_.exchange(Waiting) != Completed) return;
+    }
+  }
+
+ private:
+  enum State { Waiting, Fetching, Completed };
+
+  bool aborted() {
+    if (!callback_ || !callback_->abort()) return false;
+    complete_(Error{IHttpRequest::Aborted, "aborted"});
+    return true;
+  }
+
+  void wait() {
+    auto timer = timer_.lock();
+    if (!timer)
+      return complete_(Error{IHttpRequest::Aborted, "http engine stopped"});
+    auto self = shared_from_this();
+    timer->schedule(std::chrono::steady_clock::now() + PAUSE_INTERVAL,
+                    [=] { self->next(); });
+  }
+
+  void received(EitherError<Piece> e) {
+    if (aborted()) return;
+    if (e.left()) {
+      if (offset_ == begin_ && cache_->uncached(source_.key_))
+        return pass();
+      return complete_(*e.left());
+    }
+    if (offset_ == begin_) {
+      version_ = e.right()->version_;
+    } else if (e.right()->version_ != version_) {
+      return complete_(
+          Error{IHttpRequest::Failure, "file changed while being read"});
+    }
+    auto& data = e.right()->data_;
+    auto chunk_begin = offset_ / CHUNK_SIZE * CHUNK_SIZE;
+    auto start = offset_ - chunk_begin;
+    if (start >= data.size()) {
+      end_ = offset_ - 1;
+    } else {
+      // A short chunk means the file ends here.
+      if (data.size() < CHUNK_SIZE)
+        end_ = std::min(end_, chunk_begin + data.size() - 1);
+      auto length = std::min<uint64_t>(data.size() - start, end_ - offset_ + 1);
+      response_->write(data.data() + start, length);
+      offset_ += length;
+      if (callback_ && end_ != UINT64_MAX)
+        callback_->progressDownload(end_ - begin_ + 1, offset_ - begin_);
+    }
+    if (state_.exchange(Completed) == Waiting) next();
+  }
+
+  // Sends the original request, the upstream doesn't serve ranges.
+  void pass() {
+    upstream_->send(complete_, data_, response_, error_stream_,
+                    std::move(callback_));
+  }
+
+  void finish() {
+    if (offset_ == begin_)
+      return complete_(IHttpRequest::Response{
+          IHttpRequest::RangeInvalid, {}, response_, error_stream_});
+    auto total = cache_->total(source_.key_);
+    IHttpRequest::HeaderParameters headers = {
+        {"content-length", std::to_string(offset_ - begin_)},
+        {"content-range", "bytes " + std::to_string(begin_) + "-" +
+                              std::to_string(offset_ - 1) + "/" +
+                              (total ? std::to_string(total) : "*")}};
+    complete_(IHttpRequest::Response{IHttpRequest::Partial, headers, response_,
+                                     error_stream_});
+  }
+
+  std::shared_ptr<RangeCache::Cache> cache_;
+  std::weak_ptr<RangeCache::Timer> timer_;
+  Source source_;
+  uint64_t begin_;
+  uint64_t end_;
+  uint64_t offset_;
+  std::string version_;
+  IHttpRequest::Pointer upstream_;
+  IHttpRequest::CompleteCallback complete_;
+  std::shared_ptr<std::istream> data_;
+  std::shared_ptr<std::ostream> response_;
+  std::shared_ptr<std::ostream> error_stream_;
+  IHttpRequest::ICallback::Pointer callback_;
+  bool sequential_;
+  std::atomic<State> state_;
+};
+
+class Request : public IHttpRequest {
+ public:
+  Request(std::shared_ptr<IHttp> http, std::shared_ptr<RangeCache::Cache> cache,
+          std::weak_ptr<RangeCache::Timer> timer, const std::string& url,
+          const std::string& method, bool follow_redirect)
+      : http_(http),
+        cache_(cache),
+        timer_(timer),
+        request_(http->create(url, method, follow_redirect)) {}
+
+  void setParameter(const std::string& parameter,
+                    const std::string& value) override {
+    request_->setParameter(parameter, value);
+  }
+
+  void setHeaderParameter(const std::string& parameter,
+                          const std::string& value) override {
+    request_->setHeaderParameter(parameter, value);
+  }
+
+  const GetParameters& parameters() const override {
+    return request_->parameters();
+  }
+
+  const HeaderParameters& headerParameters() const override {
+    return request_->headerParameters();
+  }
+
+  const std::string& url() const override { return request_->url(); }
+
+  const std::string& method() const override { return request_->method(); }
+
+  bool follow_redirect() const override { return request_->follow_redirect(); }
+
+  void send(CompleteCallback on_completed, std::shared_ptr<std::istream> data,
+            std::shared_ptr<std::ostream> response,
+            std::shared_ptr<std::ostream> error_stream,
+            ICallback::Pointer callback) const override {
+    Source source{http_, url(), follow_redirect(), parameters(), {}, url()};
+    uint64_t begin = 0, end = 0;
+    bool ranged = false;
+    for (const auto& h : headerParameters())
+      if (equals_ignore_case(h.first, "Range"))
+        ranged = parse_range(h.second, &begin, &end);
+      else
+        source.headers_.insert(h);
+    if (method() != "GET" || !ranged)
+      return request_->send(on_completed, data, response, error_stream,
+                            std::move(callback));
+    std::map<std::string, std::string> parameters(source.parameters_.begin(),
+                                                  source.parameters_.end()),
+        headers(source.headers_.begin(), source.headers_.end());
+    for (const auto& p : parameters)
+      source.key_ += "\n" + p.first + "=" + p.second;
+    for (const auto& h : headers)
+      source.key_ += "\n" + h.first + ":" + h.second;
+    if (cache_->uncached(source.key_))
+      return request_->send(on_completed, data, response, error_stream,
+                            std::move(callback));
+    std::make_shared<Transfer>(cache_, timer_, source, begin, end, request_,
+                               on_completed, data, response, error_stream,
+                               std::move(callback))
+        ->next();
+  }
+
+ private:
+  std::shared_ptr<IHttp> http_;
+  std::shared_ptr<RangeCache::Cache> cache_;
+  std::weak_ptr<RangeCache::Timer> timer_;
+  IHttpRequest::Pointer request_;
+};
+
+}  // namespace
+
+RangeCache::RangeCache(std::shared_ptr<IHttp> http, uint64_t size)
+    : http_(http),
+      cache_(std::make_shared<Cache>(size)),
+      timer_(std::make_shared<Timer>()) {}
+
+IHttpRequest::Pointer RangeCache::create(const std::string& url,
+                                         const std::string& method,
+                                         bool follow_redirect) const {
+  return std::make_shared<Request>(http_, cache_, timer_, url, method,
+                                   follow_redirect);
+}
+
+RangeCache::Stats RangeCache::stats() const { return cache_->stats(); }
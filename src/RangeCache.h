@@ -0,0 +1,50 @@
+#ifndef RANGE_CACHE_H
+#define RANGE_CACHE_H
+
+#include <cloudstorage/IHttp.h>
+#include <atomic>
+#include <memory>
+
+using cloudstorage::IHttp;
+using cloudstorage::IHttpRequest;
+
+// Serves ranged GET requests, which is how providers download file contents
+// for /files, from a byte-bounded cache of fixed-size chunks. Concurrent
+// requests for the same chunk share one upstream fetch and sequential readers
+// get the following chunks fetched ahead of time. Mp4 files with the index
+// at the end get that tail fetched as soon as their first chunk arrives.
+// Chunks remember the upstream's ETag or Last-Modified: a chunk of a newer
+// version drops the older ones, and a read spanning two versions fails.
+// Files whose upstream ignores Range aren't cached at all. Reads stop when
+// their callback aborts and wait while it pauses.
+class RangeCache : public IHttp {
+ public:
+  struct Stats {
+    uint64_t hits_;
+    uint64_t misses_;
+    uint64_t coalesced_;
+    uint64_t prefetched_;
+    uint64_t tails_;
+    uint64_t invalidated_;
+    uint64_t uncached_;
+    uint64_t size_;
+  };
+
+  RangeCache(std::shared_ptr<IHttp> http, uint64_t size);
+
+  IHttpRequest::Pointer create(const std::string& url,
+                               const std::string& method,
+                               bool follow_redirect) const override;
+
+  Stats stats() const;
+
+  class Cache;
+  class Timer;
+
+ private:
+  std::shared_ptr<IHttp> http_;
+  std::shared_ptr<Cache> cache_;
+  std::shared_ptr<Timer> timer_;
+};
+
+#endif  // RANGE_CACHE_H
@@ -0,0 +1,497 @@
+#include "RateLimiter.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <deque>
+#include <random>
+#include <sstream>
+#include <vector>
+
+using cloudstorage::EitherError;
+
+const double DEFAULT_MAX_RATE = 50;
+const double DEFAULT_MIN_RATE = 0.5;
+const double DEFAULT_BURST = 50;
+const int DEFAULT_RETRIES = 4;
+const int DEFAULT_MAX_HELD = 256;
+const int DEFAULT_MAX_WAIT = 30;
+const int TOO_MANY_REQUESTS = 429;
+const size_t MAX_IDLE_BUCKETS = 256;
+const auto BASE_BACKOFF = std::chrono::milliseconds(500);
+const auto MAX_BACKOFF = std::chrono::milliseconds(30000);
+// Requests aren't held longer than that, the error goes to the caller instead.
+const auto MAX_RETRY_AFTER = std::chrono::milliseconds(60000);
+// Rejections arriving within that time of a rate decrease are taken as part
+// of the same overload and don't decrease it again.
+const auto DECREASE_INTERVAL = std::chrono::milliseconds(1000);
+
+using Clock = std::chrono::steady_clock;
+
+class RateLimiter::Bucket : public std::enable_shared_from_this<Bucket> {
+ public:
+  struct Stats {
+    std::string provider_;
+    double rate_;
+    bool throttled_;
+    uint64_t held_;
+    uint64_t rejected_;
+    uint64_t retried_;
+    uint64_t shed_;
+  };
+
+  // Called with the status code and Retry-After, in seconds, to fail a
+  // request with.
+  using Reject = std::function<void(int, int)>;
+
+  Bucket(RateLimiter* limiter, const std::string& provider, double max_rate,
+         double min_rate, double burst, size_t max_held,
+         std::chrono::milliseconds max_wait)
+      : limiter_(limiter),
+        provider_(provider),
+        max_rate_(max_rate),
+        min_rate_(min_rate),
+        burst_(burst),
+        max_held_(max_held),
+        max_wait_(max_wait),
+        rate_(max_rate),
+        tokens_(burst),
+        updated_(Clock::now()),
+        code_(IHttpRequest::ServiceUnavailable),
+        scheduled_(),
+        rejected_(),
+        retried_(),
+        shed_() {}
+
+  // Runs |f| now if the bucket allows, otherwise holds it until it does.
+  // Requests not fitting in the queue or held for too long get |reject|ed
+  // with the status the upstream last throttled with.
+  void acquire(std::function<void()> f, Reject reject) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    refill();
+    auto now = Clock::now();
+    if (held_.empty() && tokens_ >= 1 && now >= blocked_until_) {
+      tokens_ -= 1;
+      lock.unlock();
+      return f();
+    }
+    if (held_.size() >= max_held_) {
+      shed_++;
+      auto code = code_;
+      auto delay = retry_after(now);
+      lock.unlock();
+      return reject(code, delay);
+    }
+    held_.push_back(Held{std::move(f), std::move(reject), now + max_wait_});
+    schedule();
+  }
+
+  void throttled(int code, std::chrono::milliseconds retry_after) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto now = Clock::now();
+    code_ = code;
+    rejected_++;
+    if (now - decreased_ > DECREASE_INTERVAL) {
+      rate_ = std::max(min_rate_, rate_ / 2);
+      decreased_ = now;
+    }
+    refill();
+    tokens_ = std::min(tokens_, 0.0);
+    blocked_until_ = std::max(blocked_until_, now + retry_after);
+  }
+
+  void succeeded() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Grows by about one request per second every second.
+    rate_ = std::min(max_rate_, rate_ + 1 / rate_);
+  }
+
+  void retried() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    retried_++;
+  }
+
+  Stats stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return {provider_, rate_, rate_ < max_rate_, held_.size(), rejected_,
+            retried_, shed_};
+  }
+
+ private:
+  struct Held {
+    std::function<void()> run_;
+    Reject reject_;
+    Clock::time_point deadline_;
+  };
+
+  // Seconds until a request would get through, as told to rejected ones.
+  int retry_after(Clock::time_point now) const {
+    auto wait = std::max(blocked_until_ - now,
+                         std::chrono::duration_cast<Clock::duration>(
+                             std::chrono::duration<double>(
+                                 (held_.size() + 1 - tokens_) / rate_)));
+    return std::max<int>(
+        1, std::chrono::duration_cast<std::chrono::seconds>(wait).count());
+  }
+
+  void refill() {
+    auto now = Clock::now();
+    auto elapsed = std::chrono::duration<double>(now - updated_).count();
+    tokens_ = std::min(burst_, tokens_ + elapsed * rate_);
+    updated_ = now;
+  }
+
+  void schedule() {
+    if (scheduled_) return;
+    scheduled_ = true;
+    auto wait = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>((1 - tokens_) / rate_));
+    auto self = shared_from_this();
+    // Wakes up for the oldest held request's deadline at the latest.
+    limiter_->schedule(std::min(held_.front().deadline_,
+                                std::max(blocked_until_, Clock::now() + wait)),
+                       [=] { self->release(); });
+  }
+
+  void release() {
+    std::vector<std::function<void()>> ready;
+    std::vector<Reject> expired;
+    int code, delay;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      scheduled_ = false;
+      refill();
+      auto now = Clock::now();
+      while (!held_.empty() && held_.front().deadline_ <= now) {
+        shed_++;
+        expired.push_back(std::move(held_.front().reject_));
+        held_.pop_front();
+      }
+      while (!held_.empty() && tokens_ >= 1 && now >= blocked_until_) {
+        tokens_ -= 1;
+        ready.push_back(std::move(held_.front().run_));
+        held_.pop_front();
+      }
+      code = code_;
+      delay = retry_after(now);
+      if (!held_.empty()) schedule();
+    }
+    for (const auto& r : expired) r(code, delay);
+    for (const auto& f : ready) f();
+  }
+
+  RateLimiter* limiter_;
+  std::string provider_;
+  double max_rate_;
+  double min_rate_;
+  double burst_;
+  size_t max_held_;
+  std::chrono::milliseconds max_wait_;
+  double rate_;
+  double tokens_;
+  Clock::time_point updated_;
+  Clock::time_point blocked_until_;
+  Clock::time_point decreased_;
+  // Status of the upstream's last throttling response.
+  int code_;
+  std::deque<Held> held_;
+  bool scheduled_;
+  uint64_t rejected_;
+  uint64_t retried_;
+  uint64_t shed_;
+  mutable std::mutex mutex_;
+};
+
+namespace {
+
+std::chrono::milliseconds retry_after(
+    const IHttpRequest::HeaderParameters& headers) {
+  for (const auto& h : headers) {
+    std::string name = h.first;
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    // Only the delay-seconds form, dates fall back to the backoff.
+    if (name == "retry-after")
+      return std::chrono::seconds(std::atoi(h.second.c_str()));
+  }
+  return std::chrono::milliseconds::zero();
+}
+
+std::chrono::milliseconds backoff(int attempt) {
+  thread_local std::mt19937 random{std::random_device()()};
+  auto limit = std::min(MAX_BACKOFF, BASE_BACKOFF * (1 << attempt));
+  std::uniform_int_distribution<int64_t> jitter(0, limit.count() / 2);
+  return limit / 2 + std::chrono::milliseconds(jitter(random));
+}
+
+class SharedCallback : public IHttpRequest::ICallback {
+ public:
+  SharedCallback(std::shared_ptr<ICallback> callback) : callback_(callback) {}
+
+  bool isSuccess(int code,
+                 const IHttpRequest::HeaderParameters& headers) const override {
+    return callback_->isSuccess(code, headers);
+  }
+
+  bool abort() override { return callback_->abort(); }
+
+  bool pause() override { return callback_->pause(); }
+
+  void progressDownload(uint64_t total, uint64_t now) override {
+    callback_->progressDownload(total, now);
+  }
+
+  void progressUpload(uint64_t total, uint64_t now) override {
+    callback_->progressUpload(total, now);
+  }
+
+ private:
+  std::shared_ptr<ICallback> callback_;
+};
+
+class Send : public std::enable_shared_from_this<Send> {
+ public:
+  Send(RateLimiter* limiter, std::shared_ptr<IHttp> http,
+       IHttpRequest::Pointer request,
+       std::shared_ptr<RateLimiter::Bucket> bucket, int retries,
+       IHttpRequest::CompleteCallback on_completed,
+       std::shared_ptr<std::istream> data,
+       std::shared_ptr<std::ostream> response,
+       std::shared_ptr<std::ostream> error_stream,
+       std::shared_ptr<IHttpRequest::ICallback> callback)
+      : limiter_(limiter),
+        http_(http),
+        request_(request),
+        bucket_(bucket),
+        retries_(retries),
+        on_completed_(on_completed),
+        data_(data),
+        response_(response),
+        error_stream_(error_stream),
+        callback_(callback),
+        attempt_() {}
+
+  void start() {
+    auto self = shared_from_this();
+    bucket_->acquire([=] { self->send(); },
+                     [=](int code, int delay) { self->reject(code, delay); });
+  }
+
+ private:
+  void send() {
+    auto request = request_;
+    if (attempt_ > 0) {
+      request = http_->create(request_->url(), request_->method(),
+                              request_->follow_redirect());
+      for (const auto& p : request_->parameters())
+        request->setParameter(p.first, p.second);
+      for (const auto& h : request_->headerParameters())
+        request->setHeaderParameter(h.first, h.second);
+      if (data_) {
+        data_->clear();
+        data_->seekg(0);
+      }
+    }
+    // A rejected attempt's body mustn't end up in front of the final one.
+    auto errors = std::make_shared<std::stringstream>();
+    auto self = shared_from_this();
+    request->send(
+        [=](EitherError<IHttpRequest::Response> e) {
+          self->completed(e, errors);
+        },
+        data_, response_, errors,
+        callback_ ? std::make_unique<SharedCallback>(callback_) : nullptr);
+  }
+
+  void reject(int code, int delay) {
+    if (error_stream_) *error_stream_ << "too many requests held";
+    on_completed_(IHttpRequest::Response{
+        code, {{"retry-after", std::to_string(delay)}}, response_,
+        error_stream_});
+  }
+
+  void completed(EitherError<IHttpRequest::Response> e,
+                 std::shared_ptr<std::stringstream> errors) {
+    auto code = e.right() ? e.right()->http_code_ : e.left()->code_;
+    if (code == TOO_MANY_REQUESTS || code == IHttpRequest::ServiceUnavailable) {
+      auto delay = e.right() ? retry_after(e.right()->headers_)
+                             : std::chrono::milliseconds::zero();
+      bucket_->throttled(code, std::min(delay, MAX_RETRY_AFTER));
+      if (attempt_ < retries_ && delay <= MAX_RETRY_AFTER) {
+        delay = std::max(delay, backoff(attempt_++));
+        bucket_->retried();
+        auto self = shared_from_this();
+        return limiter_->schedule(Clock::now() + delay,
+                                  [=] { self->start(); });
+      }
+    } else if (code >= 200 && code < 400) {
+      // Transport failures and other errors tell nothing about the rate.
+      bucket_->succeeded();
+    }
+    if (error_stream_) *error_stream_ << errors->str();
+    if (e.right()) e.right()->error_stream_ = error_stream_;
+    on_completed_(e);
+  }
+
+  RateLimiter* limiter_;
+  std::shared_ptr<IHttp> http_;
+  IHttpRequest::Pointer request_;
+  std::shared_ptr<RateLimiter::Bucket> bucket_;
+  int retries_;
+  IHttpRequest::CompleteCallback on_completed_;
+  std::shared_ptr<std::istream> data_;
+  std::shared_ptr<std::ostream> response_;
+  std::shared_ptr<std::ostream> error_stream_;
+  std::shared_ptr<IHttpRequest::ICallback> callback_;
+  int attempt_;
+};
+
+class ThrottledRequest : public IHttpRequest {
+ public:
+  ThrottledRequest(RateLimiter* limiter, std::shared_ptr<IHttp> http,
+                   IHttpRequest::Pointer request,
+                   std::shared_ptr<RateLimiter::Bucket> bucket, int retries)
+      : limiter_(limiter),
+        http_(http),
+        request_(request),
+        bucket_(bucket),
+        retries_(retries) {}
+
+  void setParameter(const std::string& parameter,
+                    const std::string& value) override {
+    request_->setParameter(parameter, value);
+  }
+
+  void setHeaderParameter(const std::string& parameter,
+                          const std::string& value) override {
+    request_->setHeaderParameter(parameter, value);
+  }
+
+  const GetParameters& parameters() const override {
+    return request_->parameters();
+  }
+
+  const HeaderParameters& headerParameters() const override {
+    return request_->headerParameters();
+  }
+
+  const std::string& url() const override { return request_->url(); }
+
+  const std::string& method() const override { return request_->method(); }
+
+  bool follow_redirect() const override { return request_->follow_redirect(); }
+
+  void send(CompleteCallback on_completed, std::shared_ptr<std::istream> data,
+            std::shared_ptr<std::ostream> response,
+            std::shared_ptr<std::ostream> error_stream,
+            ICallback::Pointer callback) const override {
+    std::make_shared<Send>(limiter_, http_, request_, bucket_, retries_,
+                           on_completed, data, response, error_stream,
+                           std::shared_ptr<ICallback>(std::move(callback)))
+        ->start();
+  }
+
+ private:
+  RateLimiter* limiter_;
+  std::shared_ptr<IHttp> http_;
+  IHttpRequest::Pointer request_;
+  std::shared_ptr<RateLimiter::Bucket> bucket_;
+  int retries_;
+};
+
+}  // namespace
+
+RateLimiter::RateLimiter(const Json::Value& config)
+    : max_rate_(config.get("max_rate", DEFAULT_MAX_RATE).asDouble()),
+      min_rate_(std::min(max_rate_,
+                         config.get("min_rate", DEFAULT_MIN_RATE).asDouble())),
+      burst_(std::max(1.0, config.get("burst", DEFAULT_BURST).asDouble())),
+      retries_(config.get("retries", DEFAULT_RETRIES).asInt()),
+      max_held_(std::max(0, config.get("max_held", DEFAULT_MAX_HELD).asInt())),
+      max_wait_(std::chrono::seconds(
+          config.get("max_wait", DEFAULT_MAX_WAIT).asInt())),
+      done_(),
+      thread_(std::bind(&RateLimiter::run, this)) {}
+
+RateLimiter::~RateLimiter() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    done_ = true;
+  }
+  condition_.notify_one();
+  thread_.join();
+}
+
+std::shared_ptr<RateLimiter::Bucket> RateLimiter::bucket(
+    const std::string& provider, const std::string& account) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto& bucket = buckets_[provider + "\n" + account];
+  if (!bucket) {
+    bucket = std::make_shared<Bucket>(this, provider, max_rate_, min_rate_,
+                                      burst_, max_held_, max_wait_);
+    // Buckets nobody refers to carry no requests, only their learned rate.
+    if (buckets_.size() > MAX_IDLE_BUCKETS)
+      for (auto it = buckets_.begin(); it != buckets_.end();)
+        it = it->second.use_count() == 1 ? buckets_.erase(it) : std::next(it);
+  }
+  return bucket;
+}
+
+IHttpRequest::Pointer RateLimiter::throttle(std::shared_ptr<IHttp> http,
+                                            IHttpRequest::Pointer request,
+                                            std::shared_ptr<Bucket> bucket) {
+  return std::make_shared<ThrottledRequest>(this, http, request, bucket,
+                                            retries_);
+}
+
+void RateLimiter::schedule(std::chrono::steady_clock::time_point time,
+                           std::function<void()> f) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    timers_.emplace(time, std::move(f));
+  }
+  condition_.notify_one();
+}
+
+Json::Value RateLimiter::stats() const {
+  std::vector<std::shared_ptr<Bucket>> buckets;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& b : buckets_) buckets.push_back(b.second);
+  }
+  Json::Value result(Json::objectValue);
+  for (const auto& b : buckets) {
+    auto stats = b->stats();
+    auto& provider = result[stats.provider_];
+    auto min_rate = provider.isMember("min_rate")
+                        ? std::min(provider["min_rate"].asDouble(), stats.rate_)
+                        : stats.rate_;
+    provider["accounts"] = provider["accounts"].asUInt64() + 1;
+    provider["throttled_accounts"] =
+        provider["throttled_accounts"].asUInt64() + stats.throttled_;
+    provider["held"] = provider["held"].asUInt64() + stats.held_;
+    provider["rejected"] = provider["rejected"].asUInt64() + stats.rejected_;
+    provider["retried"] = provider["retried"].asUInt64() + stats.retried_;
+    provider["shed"] = provider["shed"].asUInt64() + stats.shed_;
+    provider["min_rate"] = min_rate;
+  }
+  return result;
+}
+
+void RateLimiter::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!done_) {
+    if (timers_.empty()) {
+      condition_.wait(lock);
+      continue;
+    }
+    auto it = timers_.begin();
+    if (it->first > Clock::now()) {
+      condition_.wait_until(lock, it->first);
+      continue;
+    }
+    auto f = std::move(it->second);
+    timers_.erase(it);
+    lock.unlock();
+    f();
+    lock.lock();
+  }
+}
@@ -0,0 +1,64 @@
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <cloudstorage/IHttp.h>
+#include <json/json.h>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using cloudstorage::IHttp;
+using cloudstorage::IHttpRequest;
+
+// Paces upstream requests with a token bucket per provider account. A bucket
+// halves its rate whenever the provider answers 429 / 503, stops for the
+// advertised Retry-After and then grows back while requests succeed.
+// Throttled requests are held and retried with jittered backoff instead of
+// failing right away, up to a bounded number and for a bounded time per
+// bucket; the rest fail with the status the upstream throttled with.
+class RateLimiter {
+ public:
+  class Bucket;
+
+  explicit RateLimiter(const Json::Value& config);
+  ~RateLimiter();
+
+  // Returns the bucket shared by all requests of |account| at |provider|.
+  std::shared_ptr<Bucket> bucket(const std::string& provider,
+                                 const std::string& account);
+
+  // Wraps |request|, which was created by |http|, to go through |bucket|.
+  IHttpRequest::Pointer throttle(std::shared_ptr<IHttp> http,
+                                 IHttpRequest::Pointer request,
+                                 std::shared_ptr<Bucket> bucket);
+
+  // Runs |f| on the limiter thread at |time|.
+  void schedule(std::chrono::steady_clock::time_point time,
+                std::function<void()> f);
+
+  Json::Value stats() const;
+
+ private:
+  void run();
+
+  double max_rate_;
+  double min_rate_;
+  double burst_;
+  int retries_;
+  size_t max_held_;
+  std::chrono::milliseconds max_wait_;
+  std::map<std::string, std::shared_ptr<Bucket>> buckets_;
+  std::multimap<std::chrono::steady_clock::time_point, std::function<void()>>
+      timers_;
+  bool done_;
+  mutable std::mutex mutex_;
+  std::condition_variable condition_;
+  std::thread thread_;
+};
+
+#endif  // RATE_LIMITER_H
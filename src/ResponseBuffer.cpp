@@ -0,0 +1,130 @@
+#include "ResponseBuffer.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "MemoryBudget.h"
+
+using Callback = IHttpServer::IResponse::ICallback;
+using ::util::memory_charge;
+using ::util::MemoryCategory;
+
+ResponseBuffer::ResponseBuffer()
+    : head_(new Node{"", {nullptr}}),
+      offset_(),
+      tail_(head_),
+      closed_(false),
+      suspended_(false),
+      detached_(false),
+      size_(),
+      drain_size_(),
+      response_() {}
+
+ResponseBuffer::~ResponseBuffer() {
+  memory_charge(MemoryCategory::Response, -static_cast<int64_t>(size_.load()));
+  while (head_) {
+    auto next = head_->next_.load();
+    delete head_;
+    head_ = next;
+  }
+}
+
+void ResponseBuffer::attach(IHttpServer::IResponse* response) {
+  std::lock_guard<std::mutex> lock(response_lock_);
+  response_ = response;
+}
+
+void ResponseBuffer::detach() {
+  std::lock_guard<std::mutex> lock(response_lock_);
+  response_ = nullptr;
+  detached_ = true;
+  drain_size_ = 0;
+  drain_ = nullptr;
+}
+
+void ResponseBuffer::compress(Encoding encoding, int level) {
+  if (encoding != Encoding::Identity)
+    compressor_ = std::make_unique<Compressor>(encoding, level);
+}
+
+void ResponseBuffer::write(std::string&& data) {
+  if (data.empty()) return;
+  if (compressor_)
+    publish(compressor_->write(data.data(), data.size()));
+  else
+    publish(std::move(data));
+}
+
+void ResponseBuffer::flush() {
+  if (compressor_) publish(compressor_->write(nullptr, 0, Z_SYNC_FLUSH));
+}
+
+void ResponseBuffer::publish(std::string&& data) {
+  if (data.empty()) return;
+  memory_charge(MemoryCategory::Response, data.size());
+  size_ += data.size();
+  auto node = new Node{std::move(data), {nullptr}};
+  tail_->next_.store(node);
+  tail_ = node;
+  if (suspended_.exchange(false)) resume();
+}
+
+void ResponseBuffer::on_drain(size_t size, std::function<void()> f) {
+  {
+    std::lock_guard<std::mutex> lock(response_lock_);
+    if (detached_) return;
+    drain_ = std::move(f);
+    drain_size_ = size;
+  }
+  if (size_ < size) drained();
+}
+
+void ResponseBuffer::close() {
+  if (compressor_) publish(compressor_->write(nullptr, 0, Z_FINISH));
+  closed_.store(true);
+  if (suspended_.exchange(false)) resume();
+}
+
+int ResponseBuffer::read(char* buffer, size_t size) {
+  while (true) {
+    bool closed = closed_.load();
+    if (auto next = head_->next_.load()) {
+      auto count = std::min(size, next->data_.size() - offset_);
+      memcpy(buffer, next->data_.data() + offset_, count);
+      offset_ += count;
+      size_ -= count;
+      memory_charge(MemoryCategory::Response, -static_cast<int64_t>(count));
+      if (size_ < drain_size_) drained();
+      if (offset_ == next->data_.size()) {
+        delete head_;
+        head_ = next;
+        head_->data_ = std::string();
+        offset_ = 0;
+      }
+      return count;
+    }
+    if (closed) return Callback::End;
+    suspended_.store(true);
+    // The producer may have published between the check above and
+    // suspended_ being set, in which case nobody would resume us.
+    if (!head_->next_.load() && !closed_.load()) return Callback::Suspend;
+    if (!suspended_.exchange(false)) return Callback::Suspend;
+  }
+}
+
+void ResponseBuffer::drained() {
+  std::function<void()> f;
+  {
+    std::lock_guard<std::mutex> lock(response_lock_);
+    if (size_ >= drain_size_) return;
+    f = std::move(drain_);
+    drain_ = nullptr;
+    drain_size_ = 0;
+  }
+  if (f) f();
+}
+
+void ResponseBuffer::resume() {
+  std::lock_guard<std::mutex> lock(response_lock_);
+  if (response_) response_->resume();
+}
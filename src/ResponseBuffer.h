@@ -0,0 +1,72 @@
+#ifndef RESPONSE_BUFFER_H
+#define RESPONSE_BUFFER_H
+
+#include <cloudstorage/IHttpServer.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "Compression.h"
+
+using cloudstorage::IHttpServer;
+
+class ResponseBuffer {
+ public:
+  using Pointer = std::shared_ptr<ResponseBuffer>;
+
+  ResponseBuffer();
+  ~ResponseBuffer();
+
+  void attach(IHttpServer::IResponse*);
+  void detach();
+
+  void compress(Encoding, int level);
+
+  void write(std::string&&);
+  void flush();
+  void close();
+  size_t size() const { return size_; }
+  bool detached() const { return detached_; }
+  void on_drain(size_t size, std::function<void()>);
+
+  int read(char* buffer, size_t size);
+
+ private:
+  struct Node {
+    std::string data_;
+    std::atomic<Node*> next_;
+  };
+
+  void publish(std::string&&);
+  void resume();
+  void drained();
+
+  Node* head_;
+  size_t offset_;
+  Node* tail_;
+  std::atomic_bool closed_;
+  std::atomic_bool suspended_;
+  std::atomic_bool detached_;
+  std::atomic<size_t> size_;
+  std::atomic<size_t> drain_size_;
+  std::mutex response_lock_;
+  IHttpServer::IResponse* response_;
+  std::function<void()> drain_;
+  std::unique_ptr<Compressor> compressor_;
+};
+
+class ResponseCallback : public IHttpServer::IResponse::ICallback {
+ public:
+  ResponseCallback(ResponseBuffer::Pointer p) : buffer_(p) {}
+
+  int putData(char* buffer, size_t size) override {
+    return buffer_->read(buffer, size);
+  }
+
+ private:
+  ResponseBuffer::Pointer buffer_;
+};
+
+#endif  // RESPONSE_BUFFER_H
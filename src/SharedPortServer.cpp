@@ -0,0 +1,202 @@
+#include "SharedPortServer.h"
+
+#include <microhttpd.h>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#if MHD_VERSION >= 0x00097002
+using MhdResult = enum MHD_Result;
+#else
+using MhdResult = int;
+#endif
+
+const size_t RESPONSE_BLOCK_SIZE = 16 << 10;
+const int LISTEN_BACKLOG = 128;
+
+namespace {
+
+class Response : public IHttpServer::IResponse {
+ public:
+  Response(MHD_Connection* connection, int code, const Headers& headers,
+           int size, ICallback::Pointer callback)
+      : connection_(connection),
+        code_(code),
+        callback_(std::move(callback)),
+        response_(MHD_create_response_from_callback(
+            size == UnknownSize ? MHD_SIZE_UNKNOWN : size,
+            RESPONSE_BLOCK_SIZE, &Response::read, this, nullptr)),
+        suspended_() {
+    for (const auto& h : headers)
+      MHD_add_response_header(response_, h.first.c_str(), h.second.c_str());
+  }
+
+  void resume() override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (suspended_) {
+      suspended_ = false;
+      MHD_resume_connection(connection_);
+    }
+  }
+
+  void completed(CompletedCallback f) override { completed_ = f; }
+
+  // Hands the response over to microhttpd, which keeps it until the
+  // connection is done with it.
+  MhdResult queue() {
+    auto result = MHD_queue_response(connection_, code_, response_);
+    MHD_destroy_response(response_);
+    response_ = nullptr;
+    return result;
+  }
+
+  void finish() {
+    if (completed_) completed_();
+  }
+
+ private:
+  static ssize_t read(void* cls, uint64_t, char* buffer, size_t size) {
+    auto r = static_cast<Response*>(cls);
+    if (!r->callback_) return MHD_CONTENT_READER_END_OF_STREAM;
+    // Held across putData so that a resume() racing with the suspension
+    // isn't lost.
+    std::lock_guard<std::mutex> lock(r->mutex_);
+    auto result = r->callback_->putData(buffer, size);
+    if (result == ICallback::Suspend) {
+      r->suspended_ = true;
+      MHD_suspend_connection(r->connection_);
+      return 0;
+    }
+    if (result == ICallback::Abort) return MHD_CONTENT_READER_END_WITH_ERROR;
+    if (result == ICallback::End) return MHD_CONTENT_READER_END_OF_STREAM;
+    return result;
+  }
+
+  MHD_Connection* connection_;
+  int code_;
+  ICallback::Pointer callback_;
+  MHD_Response* response_;
+  CompletedCallback completed_;
+  bool suspended_;
+  std::mutex mutex_;
+};
+
+class Request : public PathRequest {
+ public:
+  Request(MHD_Connection* connection, const char* url, const char* method)
+      : connection_(connection), url_(url), method_(method) {}
+
+  const char* get(const std::string& name) const override {
+    return MHD_lookup_connection_value(connection_, MHD_GET_ARGUMENT_KIND,
+                                       name.c_str());
+  }
+
+  const char* header(const std::string& name) const override {
+    return MHD_lookup_connection_value(connection_, MHD_HEADER_KIND,
+                                       name.c_str());
+  }
+
+  std::string url() const override { return url_; }
+
+  const char* path() const override { return url_; }
+
+  std::string method() const override { return method_; }
+
+  IHttpServer::IResponse::Pointer response(
+      int code, const IHttpServer::IResponse::Headers& headers, int size,
+      IHttpServer::IResponse::ICallback::Pointer callback) const override {
+    return std::make_unique<Response>(connection_, code, headers, size,
+                                      std::move(callback));
+  }
+
+ private:
+  MHD_Connection* connection_;
+  const char* url_;
+  const char* method_;
+};
+
+struct Connection {
+  IHttpServer::IResponse::Pointer response_;
+};
+
+MhdResult handle(void* cls, MHD_Connection* connection, const char* url,
+                 const char* method, const char*, const char*,
+                 size_t* upload_data_size, void** con_cls) {
+  if (!*con_cls) {
+    *con_cls = new Connection();
+    return MHD_YES;
+  }
+  if (*upload_data_size > 0) {
+    *upload_data_size = 0;
+    return MHD_YES;
+  }
+  auto callback = static_cast<IHttpServer::ICallback*>(cls);
+  auto response = callback->handle(Request(connection, url, method));
+  if (!response) return MHD_NO;
+  auto result = static_cast<Response*>(response.get())->queue();
+  static_cast<Connection*>(*con_cls)->response_ = std::move(response);
+  return result;
+}
+
+void completed(void*, MHD_Connection*, void** con_cls,
+               enum MHD_RequestTerminationCode) {
+  auto connection = static_cast<Connection*>(*con_cls);
+  if (!connection) return;
+  if (connection->response_)
+    static_cast<Response*>(connection->response_.get())->finish();
+  delete connection;
+  *con_cls = nullptr;
+}
+
+int listen_socket(uint16_t port) {
+#ifdef __linux__
+  auto fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    throw std::runtime_error(std::string("socket: ") + strerror(errno));
+  int one = 1;
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port);
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0 ||
+      bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+      listen(fd, LISTEN_BACKLOG) != 0) {
+    auto error = errno;
+    close(fd);
+    throw std::runtime_error("couldn't listen on port " +
+                             std::to_string(port) + ": " + strerror(error));
+  }
+  return fd;
+#else
+  throw std::runtime_error("shared ports are not supported");
+#endif
+}
+
+}  // namespace
+
+SharedPortServer::SharedPortServer(IHttpServer::ICallback::Pointer callback,
+                                   uint16_t port)
+    : callback_(callback) {
+  auto fd = listen_socket(port);
+  daemon_ = MHD_start_daemon(
+      MHD_USE_INTERNAL_POLLING_THREAD | MHD_ALLOW_SUSPEND_RESUME, port,
+      nullptr, nullptr, &handle, callback_.get(), MHD_OPTION_LISTEN_SOCKET, fd,
+      MHD_OPTION_NOTIFY_COMPLETED, &completed, nullptr, MHD_OPTION_END);
+  if (!daemon_) {
+#ifdef __linux__
+    close(fd);
+#endif
+    throw std::runtime_error("couldn't start http server");
+  }
+}
+
+SharedPortServer::~SharedPortServer() { MHD_stop_daemon(daemon_); }
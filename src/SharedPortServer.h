@@ -0,0 +1,35 @@
+#ifndef SHARED_PORT_SERVER_H
+#define SHARED_PORT_SERVER_H
+
+#include <cloudstorage/IHttpServer.h>
+#include <cstdint>
+
+using cloudstorage::IHttpServer;
+
+struct MHD_Daemon;
+
+// Implemented by the requests of SharedPortServer, whose path can be read
+// without copying it.
+class PathRequest : public IHttpServer::IRequest {
+ public:
+  // Valid for as long as the request.
+  virtual const char* path() const = 0;
+};
+
+// Serves |callback| with microhttpd on a listening socket created with
+// SO_REUSEPORT, so that the workers of a group accept connections on the same
+// port. libcloudstorage's server binds its socket itself and can't set the
+// option.
+class SharedPortServer : public IHttpServer {
+ public:
+  SharedPortServer(IHttpServer::ICallback::Pointer callback, uint16_t port);
+  ~SharedPortServer();
+
+  ICallback::Pointer callback() const override { return callback_; }
+
+ private:
+  ICallback::Pointer callback_;
+  MHD_Daemon* daemon_;
+};
+
+#endif  // SHARED_PORT_SERVER_H
@@ -0,0 +1,236 @@
+#include "Soak.h"
+
+#include <algorithm>
+#include <future>
+#include <sstream>
+#include <thread>
+
+#include "CurlMultiHttp.h"
+#include "HttpServer.h"
+#include "Utility.h"
+
+using ::util::log;
+using ::util::LogLevel;
+
+const int DEFAULT_SOAK_DURATION = 3600;
+const int DEFAULT_SOAK_WARMUP = 60;
+const int DEFAULT_SOAK_INTERVAL = 10;
+const int DEFAULT_SOAK_CONCURRENCY = 4;
+const int DEFAULT_SOAK_REQUEST_TIMEOUT = 60;
+const double DEFAULT_SOAK_RELATIVE_GROWTH = 0.25;
+const uint64_t DEFAULT_SOAK_COUNT_GROWTH = 16;
+// Consecutive samples which all have to exceed a threshold, so that a single
+// burst doesn't fail the run.
+const size_t SOAK_WINDOW = 3;
+// Added to the relative thresholds so that gauges starting near zero don't
+// trip on noise.
+const uint64_t SOAK_BYTE_SLACK = 16 << 20;
+
+namespace {
+
+// Byte sized gauges are checked against a relative threshold, the others
+// against an absolute one.
+bool relative(const std::string& gauge) {
+  return gauge == "rss" || gauge == "buffered";
+}
+
+}  // namespace
+
+Soak::Soak(Json::Value config)
+    : config_(config),
+      base_url_("http://127.0.0.1:" + config["port"].asString()),
+      duration_(config["soak"].get("duration", DEFAULT_SOAK_DURATION).asInt()),
+      warmup_(config["soak"].get("warmup", DEFAULT_SOAK_WARMUP).asInt()),
+      interval_(std::max(
+          1, config["soak"].get("interval", DEFAULT_SOAK_INTERVAL).asInt())),
+      request_timeout_(std::max(1, config["soak"]
+                                       .get("request_timeout",
+                                            DEFAULT_SOAK_REQUEST_TIMEOUT)
+                                       .asInt())),
+      concurrency_(std::max(1, config["soak"]
+                                   .get("concurrency", DEFAULT_SOAK_CONCURRENCY)
+                                   .asInt())),
+      max_relative_growth_(
+          config["soak"]
+              .get("max_relative_growth", DEFAULT_SOAK_RELATIVE_GROWTH)
+              .asDouble()),
+      max_count_growth_(
+          config["soak"]
+              .get("max_count_growth", Json::UInt64(DEFAULT_SOAK_COUNT_GROWTH))
+              .asUInt64()),
+      stopped_(),
+      sent_(),
+      failed_() {
+  const auto& soak = config["soak"];
+  // The recording is taken by running the same workload once with
+  // http_recording in record mode against the real account.
+  if (soak.isMember("recording")) {
+    config_["http_recording"]["mode"] = "replay";
+    config_["http_recording"]["path"] = soak["recording"];
+    if (soak.isMember("latency_scale"))
+      config_["http_recording"]["latency_scale"] = soak["latency_scale"];
+  }
+  for (const auto& r : soak["requests"])
+    requests_.push_back({base_url_ + r.asString(), {}, false});
+  if (requests_.empty() && soak.isMember("provider") &&
+      soak.isMember("file")) {
+    std::map<std::string, std::string> directory = {
+        {"provider", soak["provider"].asString()},
+        {"token", soak["token"].asString()},
+        {"item_id", soak.get("directory", "root").asString()}};
+    auto file = directory;
+    file["item_id"] = soak["file"].asString();
+    requests_ = {{base_url_ + "/list_directory", directory, false},
+                 {base_url_ + "/thumbnail", file, false},
+                 {base_url_ + "/get_item_data", file, true}};
+  }
+}
+
+int Soak::exec() {
+  if (requests_.empty()) {
+    log(LogLevel::Error,
+        "soak: needs soak.provider, soak.token and soak.file, or "
+        "soak.requests");
+    return 1;
+  }
+  HttpServer server(config_);
+  auto server_result = std::async(std::launch::async, [&] {
+    return server.exec();
+  });
+  auto start_time = std::chrono::steady_clock::now();
+  auto deadline = start_time + duration_;
+  std::vector<std::thread> drivers;
+  for (int i = 0; i < concurrency_; i++)
+    drivers.emplace_back([=] { drive(deadline); });
+  log("soak: running", requests_.size(), "endpoints with", concurrency_,
+      "clients for", duration_.count(), "s");
+
+  Sample baseline;
+  std::vector<Sample> window;
+  std::vector<std::string> grown;
+  while (grown.empty() && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(interval_);
+    auto current = sample(server);
+    auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::steady_clock::now() - start_time);
+    std::stringstream line;
+    for (const auto& g : current) line << g.first << "=" << g.second << " ";
+    log("soak:", elapsed.count(), "s", line.str(), "sent", sent_.load(),
+        "failed", failed_.load());
+    if (elapsed < warmup_) continue;
+    if (baseline.empty()) {
+      baseline = current;
+      continue;
+    }
+    window.push_back(current);
+    if (window.size() > SOAK_WINDOW) window.erase(window.begin());
+    if (window.size() == SOAK_WINDOW) grown = check(baseline, window);
+  }
+
+  stopped_ = true;
+  for (auto& t : drivers) t.join();
+  auto quit = std::make_shared<CurlMultiHttp>()->create(base_url_ + "/quit",
+                                                        "GET", true);
+  std::promise<void> quit_done;
+  quit->send(
+      [&](EitherError<IHttpRequest::Response>) { quit_done.set_value(); },
+      std::make_shared<std::stringstream>(),
+      std::make_shared<std::stringstream>(),
+      std::make_shared<std::stringstream>());
+  quit_done.get_future().wait();
+  server_result.wait();
+
+  if (baseline.empty()) {
+    log(LogLevel::Error, "soak: too short to take a baseline");
+    return 1;
+  }
+  for (const auto& g : grown)
+    log(LogLevel::Error, "soak:", g, "grew from", baseline[g], "to",
+        window.back().at(g));
+  log(grown.empty() ? "soak: passed" : "soak: failed", "sent", sent_.load(),
+      "failed", failed_.load());
+  return grown.empty() ? 0 : 1;
+}
+
+void Soak::drive(std::chrono::steady_clock::time_point deadline) {
+  CurlMultiHttp http;
+  size_t index = std::hash<std::thread::id>()(std::this_thread::get_id());
+  while (!stopped_ && std::chrono::steady_clock::now() < deadline) {
+    const auto& r = requests_[index++ % requests_.size()];
+    std::string body;
+    auto status = fetch(http, r, &body);
+    if (r.download_ && IHttpRequest::isSuccess(status)) {
+      auto url = file_url(body);
+      status = url.empty() ? IHttpRequest::Failure
+                           : fetch(http, {url, {}, false}, nullptr);
+    }
+    if (!IHttpRequest::isSuccess(status) &&
+        status != IHttpRequest::NotModified) {
+      failed_++;
+      log(LogLevel::Debug, "soak:", r.url_, "returned", status);
+    }
+  }
+}
+
+int Soak::fetch(CurlMultiHttp& http, const Request& r,
+                std::string* body) {
+  auto request = http.create(r.url_, "GET", true);
+  for (const auto& p : r.parameters_) request->setParameter(p.first, p.second);
+  // Outlives this call if the request times out.
+  auto code = std::make_shared<std::promise<int>>();
+  auto result = code->get_future();
+  auto response = std::make_shared<std::stringstream>();
+  request->send(
+      [code](EitherError<IHttpRequest::Response> e) {
+        code->set_value(e.right() ? e.right()->http_code_ : e.left()->code_);
+      },
+      std::make_shared<std::stringstream>(), response,
+      std::make_shared<std::stringstream>());
+  sent_++;
+  if (result.wait_for(request_timeout_) == std::future_status::timeout) {
+    log(LogLevel::Warning, "soak:", r.url_, "timed out");
+    return IHttpRequest::Failure;
+  }
+  if (body) *body = response->str();
+  return result.get();
+}
+
+std::string Soak::file_url(const std::string& body) const {
+  Json::Value json;
+  if (!Json::Reader().parse(body, json) || !json["url"].isString())
+    return "";
+  auto url = json["url"].asString();
+  auto prefix = config_["file_url"].asString() + "/" +
+                config_["soak"]["provider"].asString();
+  if (url.compare(0, prefix.size(), prefix) != 0) return url;
+  return base_url_ + url.substr(prefix.size());
+}
+
+Soak::Sample Soak::sample(const HttpServer& server) const {
+  auto metrics = server.process_metrics();
+  Sample result;
+  result["rss"] = metrics["process"]["rss"].asUInt64();
+  result["fds"] = metrics["process"]["fds"].asUInt64();
+  result["threads"] = metrics["process"]["threads"].asUInt64();
+  result["sessions"] = metrics["sessions"].asUInt64();
+  result["callbacks"] = metrics["callbacks"].asUInt64();
+  result["pending_requests"] = metrics["pending_requests"].asUInt64();
+  result["buffered"] = metrics["memory"]["used"].asUInt64();
+  return result;
+}
+
+std::vector<std::string> Soak::check(const Sample& baseline,
+                                     const std::vector<Sample>& window) const {
+  std::vector<std::string> result;
+  for (const auto& g : baseline) {
+    auto allowed =
+        relative(g.first)
+            ? uint64_t(g.second * (1 + max_relative_growth_)) + SOAK_BYTE_SLACK
+            : g.second + max_count_growth_;
+    auto exceeded = std::all_of(window.begin(), window.end(), [&](auto& s) {
+      return s.at(g.first) > allowed;
+    });
+    if (exceeded) result.push_back(g.first);
+  }
+  return result;
+}
@@ -0,0 +1,62 @@
+#ifndef SOAK_H
+#define SOAK_H
+
+#include <json/json.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+class CurlMultiHttp;
+class HttpServer;
+
+// Runs the server in this process and drives a mixed workload against it for
+// hours. Upstream traffic is replayed from a recording, so the provider
+// endpoints run without network access. Process resources and the server's
+// registries are sampled periodically and the run fails once any of them
+// grows past its threshold over the baseline taken after the warm-up.
+class Soak {
+ public:
+  using Sample = std::map<std::string, uint64_t>;
+
+  explicit Soak(Json::Value config);
+
+  int exec();
+
+ private:
+  struct Request {
+    std::string url_;
+    std::map<std::string, std::string> parameters_;
+    // Whether to download the url found in the response, the way clients
+    // follow /get_item_data.
+    bool download_;
+  };
+
+  void drive(std::chrono::steady_clock::time_point deadline);
+  // Returns the status, or Failure once the request takes too long.
+  int fetch(CurlMultiHttp&, const Request&, std::string* body);
+  // Maps the url of a /get_item_data response onto this server.
+  std::string file_url(const std::string& body) const;
+  Sample sample(const HttpServer&) const;
+  // Returns the names of gauges which grew too much.
+  std::vector<std::string> check(const Sample& baseline,
+                                 const std::vector<Sample>& window) const;
+
+  Json::Value config_;
+  std::string base_url_;
+  std::vector<Request> requests_;
+  std::chrono::seconds duration_;
+  std::chrono::seconds warmup_;
+  std::chrono::seconds interval_;
+  std::chrono::seconds request_timeout_;
+  int concurrency_;
+  double max_relative_growth_;
+  uint64_t max_count_growth_;
+  std::atomic_bool stopped_;
+  std::atomic<uint64_t> sent_;
+  std::atomic<uint64_t> failed_;
+};
+
+#endif  // SOAK_H
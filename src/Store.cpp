@@ -0,0 +1,246 @@
+#include "Store.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+
+const uint64_t STORE_MAGIC = 0x3165726f74537363ULL;
+const uint32_t STORE_VERSION = 2;
+const int SEGMENT_COUNT = 4;
+const int MAX_PROBE = 16;
+const uint64_t BYTES_PER_SLOT = 4096;
+
+struct Store::Header {
+  uint64_t magic_;
+  uint32_t version_;
+  uint32_t slot_count_;
+  uint64_t segment_size_;
+  std::atomic<uint64_t> generation_;
+  std::atomic<uint64_t> offset_;
+};
+
+// Records are the value followed by the full key, so that a hash collision
+// never hands out another key's value.
+struct Store::Entry {
+  std::atomic<uint32_t> sequence_;
+  std::atomic<uint32_t> length_;
+  std::atomic<uint32_t> key_length_;
+  std::atomic<uint64_t> key_;
+  std::atomic<uint64_t> generation_;
+  std::atomic<uint64_t> offset_;
+  std::atomic<uint64_t> checksum_;
+  std::atomic<int64_t> time_;
+};
+
+namespace {
+
+const uint64_t FNV_OFFSET = 0xcbf29ce484222325ULL;
+const uint64_t FNV_PRIME = 0x100000001b3ULL;
+
+uint64_t hash(const char* data, size_t length, uint64_t h = FNV_OFFSET) {
+  for (size_t i = 0; i < length; i++) {
+    h ^= static_cast<uint8_t>(data[i]);
+    h *= FNV_PRIME;
+  }
+  return h;
+}
+
+uint64_t key_hash(const std::string& key) {
+  auto h = hash(key.data(), key.size());
+  return h == 0 ? 1 : h;
+}
+
+int64_t now() {
+  return std::chrono::duration_cast<std::chrono::seconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+void* map(int fd, size_t size, bool& fresh) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) throw std::runtime_error("fstat failed");
+  fresh = static_cast<size_t>(st.st_size) != size;
+  if (fresh && (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0))
+    throw std::runtime_error("ftruncate failed");
+  auto ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (ptr == MAP_FAILED) throw std::runtime_error("mmap failed");
+  return ptr;
+}
+
+int open_file(const std::string& path) {
+  auto fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd == -1) throw std::runtime_error("couldn't open " + path);
+  return fd;
+}
+
+struct FileLock {
+  FileLock(int fd) : fd_(fd) { flock(fd_, LOCK_EX); }
+  ~FileLock() { flock(fd_, LOCK_UN); }
+
+  int fd_;
+};
+
+}  // namespace
+
+Store::Store(const std::string& directory, uint64_t size)
+    : segment_size_(size / SEGMENT_COUNT / 8 * 8),
+      slot_count_(4096),
+      index_fd_(-1),
+      index_size_(),
+      header_() {
+  while (slot_count_ < size / BYTES_PER_SLOT) slot_count_ *= 2;
+  if (segment_size_ == 0) throw std::runtime_error("store size too small");
+  mkdir(directory.c_str(), 0700);
+  index_fd_ = open_file(directory + "/index");
+  FileLock lock(index_fd_);
+  index_size_ = sizeof(Header) + slot_count_ * sizeof(Entry);
+  bool fresh;
+  header_ = static_cast<Header*>(map(index_fd_, index_size_, fresh));
+  if (fresh || header_->magic_ != STORE_MAGIC ||
+      header_->version_ != STORE_VERSION ||
+      header_->slot_count_ != slot_count_ ||
+      header_->segment_size_ != segment_size_) {
+    memset(static_cast<void*>(header_), 0, index_size_);
+    header_->version_ = STORE_VERSION;
+    header_->slot_count_ = slot_count_;
+    header_->segment_size_ = segment_size_;
+    header_->generation_ = SEGMENT_COUNT;
+    header_->offset_ = 0;
+    msync(header_, index_size_, MS_SYNC);
+    header_->magic_ = STORE_MAGIC;
+  }
+  for (int i = 0; i < SEGMENT_COUNT; i++) {
+    segment_fd_.push_back(
+        open_file(directory + "/data." + std::to_string(i)));
+    segment_.push_back(
+        static_cast<uint8_t*>(map(segment_fd_.back(), segment_size_, fresh)));
+  }
+}
+
+Store::~Store() {
+  for (size_t i = 0; i < segment_.size(); i++) {
+    munmap(segment_[i], segment_size_);
+    close(segment_fd_[i]);
+  }
+  if (header_) munmap(header_, index_size_);
+  if (index_fd_ != -1) close(index_fd_);
+}
+
+Store::Entry* Store::entry(uint64_t key, int probe) const {
+  auto entries = reinterpret_cast<Entry*>(header_ + 1);
+  return &entries[(key + probe) & (slot_count_ - 1)];
+}
+
+bool Store::alive(uint64_t generation) const {
+  auto current = header_->generation_.load();
+  return generation <= current && generation + SEGMENT_COUNT > current;
+}
+
+std::shared_ptr<std::string> Store::get(const std::string& key,
+                                        std::chrono::seconds max_age) const {
+  auto h = key_hash(key);
+  for (int i = 0; i < MAX_PROBE; i++) {
+    auto e = entry(h, i);
+    auto sequence = e->sequence_.load(std::memory_order_acquire);
+    auto entry_key = e->key_.load(std::memory_order_relaxed);
+    if (entry_key == 0 && sequence == 0) return nullptr;
+    if (sequence % 2 == 1 || entry_key != h) continue;
+    uint64_t generation = e->generation_.load(std::memory_order_relaxed);
+    uint64_t offset = e->offset_.load(std::memory_order_relaxed);
+    uint64_t length = e->length_.load(std::memory_order_relaxed);
+    uint64_t key_length = e->key_length_.load(std::memory_order_relaxed);
+    uint64_t checksum = e->checksum_.load(std::memory_order_relaxed);
+    int64_t time = e->time_.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (e->sequence_.load(std::memory_order_relaxed) != sequence) return nullptr;
+    if (!alive(generation) || offset + length + key_length > segment_size_)
+      return nullptr;
+    if (max_age.count() > 0 && now() - time > max_age.count()) return nullptr;
+    auto data = reinterpret_cast<const char*>(
+        segment_[generation % SEGMENT_COUNT] + offset);
+    auto result = std::make_shared<std::string>(data, length + key_length);
+    // The segment may have been recycled while copying, or the entry may
+    // point at an append that didn't make it to disk before a crash.
+    if (hash(result->data(), result->size()) != checksum || !alive(generation))
+      return nullptr;
+    if (key_length != key.size() ||
+        result->compare(length, key_length, key) != 0)
+      continue;
+    result->resize(length);
+    return result;
+  }
+  return nullptr;
+}
+
+void Store::put(const std::string& key, const std::string& value) {
+  put(key, value.size(), [&](char* output, uint64_t& checksum) {
+    memcpy(output, value.data(), value.size());
+    checksum = hash(value.data(), value.size());
+  });
+}
+
+void Store::put(const std::string& key, const ChunkBuffer& value) {
+  put(key, value.size(), [&](char* output, uint64_t& checksum) {
+    checksum = FNV_OFFSET;
+    value.for_each([&](const char* data, size_t length) {
+      memcpy(output, data, length);
+      output += length;
+      checksum = hash(data, length, checksum);
+    });
+  });
+}
+
+template <class Write>
+void Store::put(const std::string& key, uint64_t length, Write write) {
+  auto record_length = length + key.size();
+  if (length == 0 || record_length > segment_size_ ||
+      record_length > UINT32_MAX)
+    return;
+  std::lock_guard<std::mutex> guard(lock_);
+  FileLock lock(index_fd_);
+  auto generation = header_->generation_.load();
+  auto offset = header_->offset_.load();
+  if (offset + record_length > segment_size_) {
+    generation++;
+    offset = 0;
+    header_->offset_ = 0;
+    header_->generation_ = generation;
+  }
+  uint64_t checksum;
+  auto output =
+      reinterpret_cast<char*>(segment_[generation % SEGMENT_COUNT] + offset);
+  write(output, checksum);
+  memcpy(output + length, key.data(), key.size());
+  checksum = hash(key.data(), key.size(), checksum);
+  header_->offset_ = (offset + record_length + 7) / 8 * 8;
+
+  auto h = key_hash(key);
+  Entry* target = nullptr;
+  for (int i = 0; i < MAX_PROBE; i++) {
+    auto e = entry(h, i);
+    auto entry_key = e->key_.load();
+    if (entry_key == 0 || entry_key == h || !alive(e->generation_.load()) ||
+        e->sequence_.load() % 2 == 1) {
+      target = e;
+      break;
+    }
+    if (!target || e->generation_.load() < target->generation_.load())
+      target = e;
+  }
+  auto sequence = target->sequence_.load() | 1;
+  target->sequence_.store(sequence, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  target->key_.store(h, std::memory_order_relaxed);
+  target->generation_.store(generation, std::memory_order_relaxed);
+  target->offset_.store(offset, std::memory_order_relaxed);
+  target->length_.store(length, std::memory_order_relaxed);
+  target->key_length_.store(key.size(), std::memory_order_relaxed);
+  target->checksum_.store(checksum, std::memory_order_relaxed);
+  target->time_.store(now(), std::memory_order_relaxed);
+  target->sequence_.store(sequence + 1, std::memory_order_release);
+}
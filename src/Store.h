@@ -0,0 +1,45 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ChunkBuffer.h"
+
+class Store {
+ public:
+  Store(const std::string& directory, uint64_t size);
+  ~Store();
+
+  std::shared_ptr<std::string> get(
+      const std::string& key,
+      std::chrono::seconds max_age = std::chrono::seconds::zero()) const;
+
+  void put(const std::string& key, const std::string& value);
+  void put(const std::string& key, const ChunkBuffer& value);
+
+ private:
+  struct Header;
+  struct Entry;
+
+  template <class Write>
+  void put(const std::string& key, uint64_t length, Write);
+
+  Entry* entry(uint64_t key, int probe) const;
+  bool alive(uint64_t generation) const;
+
+  uint64_t segment_size_;
+  uint32_t slot_count_;
+  int index_fd_;
+  size_t index_size_;
+  Header* header_;
+  std::vector<int> segment_fd_;
+  std::vector<uint8_t*> segment_;
+  std::mutex lock_;
+};
+
+#endif  // STORE_H
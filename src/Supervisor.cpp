@@ -0,0 +1,344 @@
+#include "Supervisor.h"
+
+#include <atomic>
+#include <csignal>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+#include "Utility.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using ::util::log;
+using ::util::LogLevel;
+
+extern char** environ;
+
+const char* WORKER_ENVIRONMENT = "CLOUDSTORAGE_WORKER";
+const size_t METRICS_SIZE = 8192;
+const int READ_ATTEMPTS = 16;
+const auto POLL_INTERVAL = std::chrono::milliseconds(100);
+const auto HEARTBEAT_TIMEOUT = std::chrono::seconds(30);
+const auto STOP_TIMEOUT = std::chrono::seconds(10);
+const auto STABLE_UPTIME = std::chrono::seconds(10);
+const auto MIN_BACKOFF = std::chrono::milliseconds(100);
+const auto MAX_BACKOFF = std::chrono::milliseconds(10000);
+
+struct WorkerStatus::Slot {
+  std::atomic<int32_t> pid_;
+  std::atomic<uint32_t> restarts_;
+  std::atomic<int64_t> heartbeat_;
+  std::atomic<uint32_t> sequence_;
+  std::atomic<uint32_t> length_;
+  char metrics_[METRICS_SIZE];
+};
+
+namespace {
+
+volatile std::sig_atomic_t terminated;
+
+int64_t now() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+std::string read(const WorkerStatus::Slot* slot) {
+  for (int i = 0; i < READ_ATTEMPTS; i++) {
+    auto sequence = slot->sequence_.load(std::memory_order_acquire);
+    if (sequence & 1) {
+      std::this_thread::yield();
+      continue;
+    }
+    auto length = std::min<size_t>(
+        slot->length_.load(std::memory_order_relaxed), METRICS_SIZE);
+    std::string data(slot->metrics_, length);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot->sequence_.load(std::memory_order_relaxed) == sequence)
+      return data;
+  }
+  return "";
+}
+
+// Sums up integer counters; ratios and other floating point values don't add
+// up across workers.
+void accumulate(Json::Value& total, const Json::Value& value) {
+  for (auto name : value.getMemberNames()) {
+    const auto& v = value[name];
+    if (v.isObject())
+      accumulate(total[name], v);
+    else if (v.isIntegral() && !v.isBool())
+      total[name] = Json::UInt64(total[name].asUInt64() + v.asUInt64());
+  }
+}
+
+}  // namespace
+
+#ifdef __linux__
+
+WorkerStatus::WorkerStatus(int worker_count)
+    : fd_(memfd_create("cloudstorage-workers", 0)),
+      worker_count_(worker_count),
+      index_(-1),
+      slots_() {
+  if (fd_ == -1) throw std::runtime_error("memfd_create");
+  auto size = sizeof(Slot) * worker_count_;
+  void* data = MAP_FAILED;
+  if (ftruncate(fd_, size) == 0)
+    data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (data == MAP_FAILED) {
+    close(fd_);
+    throw std::runtime_error("couldn't map worker status");
+  }
+  slots_ = static_cast<Slot*>(data);
+  for (int i = 0; i < worker_count_; i++) new (slots_ + i) Slot{};
+}
+
+WorkerStatus::WorkerStatus(int fd, int worker_count, int index)
+    : fd_(fd), worker_count_(worker_count), index_(index), slots_() {
+  auto data = mmap(nullptr, sizeof(Slot) * worker_count_,
+                   PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (data == MAP_FAILED) {
+    close(fd_);
+    throw std::runtime_error("couldn't map worker status");
+  }
+  slots_ = static_cast<Slot*>(data);
+}
+
+WorkerStatus::~WorkerStatus() {
+  munmap(slots_, sizeof(Slot) * worker_count_);
+  close(fd_);
+}
+
+std::unique_ptr<WorkerStatus> WorkerStatus::attach() {
+  auto value = getenv(WORKER_ENVIRONMENT);
+  int index, worker_count, fd;
+  if (!value ||
+      sscanf(value, "%d:%d:%d", &index, &worker_count, &fd) != 3 ||
+      index < 0 || index >= worker_count)
+    return nullptr;
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return std::unique_ptr<WorkerStatus>(
+      new WorkerStatus(fd, worker_count, index));
+}
+
+#else
+
+WorkerStatus::WorkerStatus(int) {
+  throw std::logic_error("worker processes not supported");
+}
+
+WorkerStatus::WorkerStatus(int fd, int worker_count, int index)
+    : fd_(fd), worker_count_(worker_count), index_(index), slots_() {}
+
+WorkerStatus::~WorkerStatus() {}
+
+std::unique_ptr<WorkerStatus> WorkerStatus::attach() { return nullptr; }
+
+#endif
+
+std::string WorkerStatus::environment(int index) const {
+  return std::string(WORKER_ENVIRONMENT) + "=" + std::to_string(index) + ":" +
+         std::to_string(worker_count_) + ":" + std::to_string(fd_);
+}
+
+WorkerStatus::Slot* WorkerStatus::slot(int index) const {
+  return slots_ + index;
+}
+
+void WorkerStatus::publish(const Json::Value& metrics) {
+  auto slot = this->slot(index_);
+  auto data = Json::FastWriter().write(metrics);
+  if (data.size() <= METRICS_SIZE) {
+    auto sequence = slot->sequence_.load(std::memory_order_relaxed);
+    slot->sequence_.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(slot->metrics_, data.data(), data.size());
+    slot->length_.store(data.size(), std::memory_order_relaxed);
+    slot->sequence_.store(sequence + 2, std::memory_order_release);
+  }
+  slot->heartbeat_ = now();
+}
+
+Json::Value WorkerStatus::collect() const {
+  Json::Value result;
+  Json::Value workers(Json::arrayValue);
+  Json::Value total(Json::objectValue);
+  auto timeout =
+      std::chrono::duration_cast<std::chrono::milliseconds>(HEARTBEAT_TIMEOUT)
+          .count();
+  for (int i = 0; i < worker_count_; i++) {
+    auto slot = this->slot(i);
+    auto heartbeat = slot->heartbeat_.load();
+    Json::Value worker;
+    worker["worker"] = i;
+    worker["pid"] = slot->pid_.load();
+    worker["restarts"] = slot->restarts_.load();
+    worker["alive"] = heartbeat != 0 && now() - heartbeat < timeout;
+    Json::Value metrics;
+    if (Json::Reader().parse(read(slot), metrics) && metrics.isObject()) {
+      accumulate(total, metrics);
+      worker["metrics"] = metrics;
+    }
+    workers.append(worker);
+  }
+  result["workers"] = workers;
+  result["total"] = total;
+  return result;
+}
+
+Supervisor::Supervisor(std::vector<std::string> arguments, int worker_count)
+    : arguments_(arguments),
+      status_(worker_count),
+      workers_(worker_count, Worker{0, {}, {}, MIN_BACKOFF}),
+      stopping_() {}
+
+#ifdef __linux__
+
+bool Supervisor::supported() { return true; }
+
+int Supervisor::exec() {
+  struct sigaction action = {};
+  action.sa_handler = [](int) { terminated = 1; };
+  sigaction(SIGTERM, &action, nullptr);
+  sigaction(SIGINT, &action, nullptr);
+  log("starting", workers_.size(), "workers");
+  for (size_t i = 0; i < workers_.size(); i++) spawn(i);
+  auto stop_time = std::chrono::steady_clock::time_point();
+  while (true) {
+    if (terminated && !stopping_) stop();
+    if (stopping_ && stop_time == std::chrono::steady_clock::time_point())
+      stop_time = std::chrono::steady_clock::now();
+    reap();
+    bool running = false;
+    for (const auto& w : workers_) running |= w.pid_ != 0;
+    if (stopping_) {
+      if (!running) return 0;
+      if (std::chrono::steady_clock::now() - stop_time > STOP_TIMEOUT)
+        for (const auto& w : workers_)
+          if (w.pid_ != 0) kill(w.pid_, SIGKILL);
+    } else {
+      check_heartbeats();
+      for (size_t i = 0; i < workers_.size(); i++)
+        if (workers_[i].pid_ == 0 &&
+            std::chrono::steady_clock::now() >= workers_[i].restart_time_)
+          spawn(i);
+    }
+    std::this_thread::sleep_for(POLL_INTERVAL);
+  }
+}
+
+void Supervisor::spawn(int index) {
+  auto& worker = workers_[index];
+  auto slot = status_.slot(index);
+  std::vector<std::string> environment;
+  for (auto e = environ; *e; e++)
+    if (strncmp(*e, WORKER_ENVIRONMENT, strlen(WORKER_ENVIRONMENT)) != 0)
+      environment.push_back(*e);
+  environment.push_back(status_.environment(index));
+  std::vector<char*> argv, envp;
+  for (auto& a : arguments_) argv.push_back(&a[0]);
+  argv.push_back(nullptr);
+  for (auto& e : environment) envp.push_back(&e[0]);
+  envp.push_back(nullptr);
+
+  slot->heartbeat_ = 0;
+  if (slot->sequence_ & 1) slot->sequence_++;
+  if (worker.start_time_ != std::chrono::steady_clock::time_point())
+    slot->restarts_++;
+  auto pid = fork();
+  if (pid == 0) {
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    execve("/proc/self/exe", argv.data(), envp.data());
+    _exit(127);
+  }
+  worker.start_time_ = std::chrono::steady_clock::now();
+  if (pid == -1) {
+    log(LogLevel::Error, "couldn't fork worker", index, strerror(errno));
+    worker.restart_time_ = worker.start_time_ + MAX_BACKOFF;
+    return;
+  }
+  worker.pid_ = pid;
+  slot->pid_ = pid;
+}
+
+void Supervisor::reap() {
+  int status;
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    for (size_t i = 0; i < workers_.size(); i++) {
+      auto& worker = workers_[i];
+      if (worker.pid_ != pid) continue;
+      worker.pid_ = 0;
+      status_.slot(i)->pid_ = 0;
+      if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        log("worker", i, "exited");
+        if (!stopping_) stop();
+        break;
+      }
+      if (stopping_) break;
+      if (WIFSIGNALED(status))
+        log(LogLevel::Error, "worker", i, "killed by signal",
+            WTERMSIG(status));
+      else
+        log(LogLevel::Error, "worker", i, "exited with code",
+            WEXITSTATUS(status));
+      auto current_time = std::chrono::steady_clock::now();
+      if (current_time - worker.start_time_ < STABLE_UPTIME)
+        worker.backoff_ = std::min(worker.backoff_ * 2, MAX_BACKOFF);
+      else
+        worker.backoff_ = MIN_BACKOFF;
+      worker.restart_time_ = current_time + worker.backoff_;
+      break;
+    }
+  }
+}
+
+void Supervisor::check_heartbeats() {
+  auto timeout =
+      std::chrono::duration_cast<std::chrono::milliseconds>(HEARTBEAT_TIMEOUT)
+          .count();
+  for (size_t i = 0; i < workers_.size(); i++) {
+    const auto& worker = workers_[i];
+    if (worker.pid_ == 0) continue;
+    auto heartbeat = status_.slot(i)->heartbeat_.load();
+    if (heartbeat == 0)
+      heartbeat = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      worker.start_time_.time_since_epoch())
+                      .count();
+    if (now() - heartbeat > timeout) {
+      log(LogLevel::Error, "worker", i, "stopped responding");
+      kill(worker.pid_, SIGKILL);
+    }
+  }
+}
+
+void Supervisor::stop() {
+  stopping_ = true;
+  for (const auto& w : workers_)
+    if (w.pid_ != 0) kill(w.pid_, SIGTERM);
+}
+
+#else
+
+bool Supervisor::supported() { return false; }
+
+int Supervisor::exec() { return 1; }
+
+void Supervisor::spawn(int) {}
+
+void Supervisor::reap() {}
+
+void Supervisor::check_heartbeats() {}
+
+void Supervisor::stop() {}
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef SUPERVISOR_H
+#define SUPERVISOR_H
+
+#include <json/json.h>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Shared memory region where every worker process publishes its heartbeat and
+// metrics, readable by all processes of the group.
+class WorkerStatus {
+ public:
+  struct Slot;
+
+  // Creates the region in the supervisor; it is inherited by the workers
+  // through exec.
+  explicit WorkerStatus(int worker_count);
+  ~WorkerStatus();
+
+  // Maps the region passed down by the supervisor, returns nullptr if this
+  // process isn't a worker.
+  static std::unique_ptr<WorkerStatus> attach();
+
+  int index() const { return index_; }
+  int worker_count() const { return worker_count_; }
+
+  // Environment variable handing the region to worker |index|.
+  std::string environment(int index) const;
+
+  Slot* slot(int index) const;
+
+  void publish(const Json::Value& metrics);
+  Json::Value collect() const;
+
+ private:
+  WorkerStatus(int fd, int worker_count, int index);
+
+  int fd_;
+  int worker_count_;
+  int index_;
+  Slot* slots_;
+};
+
+// Runs |worker_count| copies of this executable bound to the same port with
+// SO_REUSEPORT, restarts the ones that crash or stop sending heartbeats, and
+// stops all of them once one exits cleanly or the supervisor is terminated.
+class Supervisor {
+ public:
+  Supervisor(std::vector<std::string> arguments, int worker_count);
+
+  static bool supported();
+
+  int exec();
+
+ private:
+  struct Worker {
+    int pid_;
+    std::chrono::steady_clock::time_point start_time_;
+    std::chrono::steady_clock::time_point restart_time_;
+    std::chrono::milliseconds backoff_;
+  };
+
+  void spawn(int index);
+  void reap();
+  void check_heartbeats();
+  void stop();
+
+  std::vector<std::string> arguments_;
+  WorkerStatus status_;
+  std::vector<Worker> workers_;
+  bool stopping_;
+};
+
+#endif  // SUPERVISOR_H
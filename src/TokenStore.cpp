@@ -0,0 +1,50 @@
+#include "TokenStore.h"
+
+#include <algorithm>
+
+const size_t MAX_SESSION_COUNT = 4096;
+
+std::shared_ptr<ICloudProvider> TokenStore::provider(const std::string& key,
+                                                     Create create) {
+  std::lock_guard<std::mutex> lock(lock_);
+  auto& entry = entries_[key];
+  entry.last_used_ = std::chrono::steady_clock::now();
+  if (auto p = entry.provider_.lock()) return p;
+  auto p = create(entry.session_.token_.empty() ? nullptr : &entry.session_);
+  entry.provider_ = p;
+  prune();
+  return p;
+}
+
+void TokenStore::update(const std::string& key, const ICloudProvider& p) {
+  auto hints = p.hints();
+  auto access_token = hints["access_token"];
+  auto token = p.token();
+  if (token.empty()) return;
+  std::lock_guard<std::mutex> lock(lock_);
+  auto& entry = entries_[key];
+  entry.session_ = {token, access_token};
+  entry.last_used_ = std::chrono::steady_clock::now();
+  prune();
+}
+
+size_t TokenStore::size() const {
+  std::lock_guard<std::mutex> lock(lock_);
+  return entries_.size();
+}
+
+void TokenStore::prune() {
+  if (entries_.size() <= MAX_SESSION_COUNT) return;
+  for (auto it = entries_.begin(); it != entries_.end();)
+    if (it->second.provider_.expired() && it->second.session_.token_.empty())
+      it = entries_.erase(it);
+    else
+      it++;
+  while (entries_.size() > MAX_SESSION_COUNT) {
+    auto oldest = std::min_element(
+        entries_.begin(), entries_.end(), [](const auto& a, const auto& b) {
+          return a.second.last_used_ < b.second.last_used_;
+        });
+    entries_.erase(oldest);
+  }
+}
@@ -0,0 +1,42 @@
+#ifndef TOKEN_STORE_H
+#define TOKEN_STORE_H
+
+#include <cloudstorage/ICloudProvider.h>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+using cloudstorage::ICloudProvider;
+
+class TokenStore {
+ public:
+  struct Session {
+    std::string token_;
+    std::string access_token_;
+  };
+
+  using Create =
+      std::function<std::shared_ptr<ICloudProvider>(const Session*)>;
+
+  std::shared_ptr<ICloudProvider> provider(const std::string& key, Create);
+  void update(const std::string& key, const ICloudProvider&);
+
+  size_t size() const;
+
+ private:
+  struct Entry {
+    std::weak_ptr<ICloudProvider> provider_;
+    Session session_;
+    std::chrono::steady_clock::time_point last_used_;
+  };
+
+  void prune();
+
+  std::unordered_map<std::string, Entry> entries_;
+  mutable std::mutex lock_;
+};
+
+#endif  // TOKEN_STORE_H
@@ -0,0 +1,118 @@
+#include "Trace.h"
+
+#include <algorithm>
+
+const size_t MAX_PHASE_COUNT = 64;
+const size_t RECENT_TRACE_COUNT = 256;
+const size_t SLOWEST_TRACE_COUNT = 8;
+
+namespace {
+
+thread_local Trace::Pointer current_trace;
+
+double milliseconds(std::chrono::steady_clock::duration d) {
+  return std::chrono::duration<double, std::milli>(d).count();
+}
+
+}  // namespace
+
+Trace::Scope::Scope(Pointer trace) : previous_(std::move(current_trace)) {
+  current_trace = std::move(trace);
+}
+
+Trace::Scope::~Scope() { current_trace = std::move(previous_); }
+
+Trace::Trace(FlightRecorder* recorder, const std::string& endpoint)
+    : recorder_(recorder),
+      endpoint_(endpoint),
+      start_wall_time_(std::chrono::system_clock::now()),
+      start_time_(Clock::now()),
+      finished_(),
+      error_() {
+  phases_.reserve(8);
+}
+
+void Trace::mark(const char* phase) {
+  auto now = Clock::now();
+  std::lock_guard<std::mutex> lock(lock_);
+  if (!finished_ && phases_.size() < MAX_PHASE_COUNT)
+    phases_.emplace_back(phase, now);
+}
+
+void Trace::finish(bool error) {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if (finished_) return;
+    finished_ = true;
+    error_ = error;
+    end_time_ = Clock::now();
+  }
+  if (recorder_) recorder_->record(shared_from_this());
+}
+
+std::chrono::steady_clock::duration Trace::duration() const {
+  std::lock_guard<std::mutex> lock(lock_);
+  return (finished_ ? end_time_ : Clock::now()) - start_time_;
+}
+
+Json::Value Trace::to_json() const {
+  std::lock_guard<std::mutex> lock(lock_);
+  Json::Value result;
+  result["endpoint"] = endpoint_;
+  result["start"] = Json::Int64(
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          start_wall_time_.time_since_epoch())
+          .count());
+  result["duration_ms"] =
+      milliseconds((finished_ ? end_time_ : Clock::now()) - start_time_);
+  result["error"] = error_;
+  Json::Value phases(Json::arrayValue);
+  for (const auto& p : phases_) {
+    Json::Value phase;
+    phase["name"] = p.first;
+    phase["at_ms"] = milliseconds(p.second - start_time_);
+    phases.append(phase);
+  }
+  result["phases"] = phases;
+  return result;
+}
+
+Trace::Pointer Trace::current() { return current_trace; }
+
+void FlightRecorder::record(Trace::Pointer trace) {
+  if (!trace) return;
+  auto duration = trace->duration();
+  std::lock_guard<std::mutex> lock(lock_);
+  recent_.push_back(trace);
+  if (recent_.size() > RECENT_TRACE_COUNT) recent_.pop_front();
+  auto& slowest = slowest_[trace->endpoint()];
+  if (slowest.size() < SLOWEST_TRACE_COUNT ||
+      slowest.back()->duration() < duration) {
+    auto it = std::find_if(slowest.begin(), slowest.end(), [&](const auto& t) {
+      return t->duration() < duration;
+    });
+    slowest.insert(it, trace);
+    if (slowest.size() > SLOWEST_TRACE_COUNT) slowest.pop_back();
+  }
+}
+
+Json::Value FlightRecorder::dump() const {
+  std::lock_guard<std::mutex> lock(lock_);
+  Json::Value result;
+  Json::Value recent(Json::arrayValue);
+  for (auto it = recent_.rbegin(); it != recent_.rend(); it++)
+    recent.append((*it)->to_json());
+  result["recent"] = recent;
+  Json::Value slowest(Json::objectValue);
+  for (const auto& e : slowest_) {
+    Json::Value traces(Json::arrayValue);
+    for (const auto& t : e.second) traces.append(t->to_json());
+    slowest[e.first] = traces;
+  }
+  result["slowest"] = slowest;
+  return result;
+}
+
+void trace_mark(const char* phase) {
+  if (auto trace = current_trace.get()) trace->mark(phase);
+}
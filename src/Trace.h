@@ -0,0 +1,73 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <json/json.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class FlightRecorder;
+
+// Timeline of a single request. Phases are recorded against the trace that is
+// current on the calling thread; hand-offs between threads (util::enqueue,
+// upstream http callbacks) carry the trace along.
+class Trace : public std::enable_shared_from_this<Trace> {
+ public:
+  using Pointer = std::shared_ptr<Trace>;
+
+  class Scope {
+   public:
+    Scope(Pointer);
+    ~Scope();
+
+   private:
+    Pointer previous_;
+  };
+
+  Trace(FlightRecorder*, const std::string& endpoint);
+
+  // |phase| has to be a string literal.
+  void mark(const char* phase);
+  void finish(bool error = false);
+
+  std::chrono::steady_clock::duration duration() const;
+  const std::string& endpoint() const { return endpoint_; }
+  Json::Value to_json() const;
+
+  static Pointer current();
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  FlightRecorder* recorder_;
+  std::string endpoint_;
+  std::chrono::system_clock::time_point start_wall_time_;
+  Clock::time_point start_time_;
+  Clock::time_point end_time_;
+  std::vector<std::pair<const char*, Clock::time_point>> phases_;
+  bool finished_;
+  bool error_;
+  mutable std::mutex lock_;
+};
+
+// Keeps the most recent finished traces and the slowest ones per endpoint.
+class FlightRecorder {
+ public:
+  void record(Trace::Pointer);
+  Json::Value dump() const;
+
+ private:
+  std::deque<Trace::Pointer> recent_;
+  std::map<std::string, std::vector<Trace::Pointer>> slowest_;
+  mutable std::mutex lock_;
+};
+
+// Marks |phase| on the trace current on this thread, if any.
+void trace_mark(const char* phase);
+
+#endif  // TRACE_H
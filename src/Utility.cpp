@@ -1,68 +1,379 @@
 #include "Utility.h"
+#include "Trace.h"
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <fstream>
 #include <sstream>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 
-const int WORKER_CNT = 1;
+#ifdef __linux__
+#include <dirent.h>
+#include <unistd.h>
+#endif
+
+const int DEFAULT_WORKER_THREADS = 2;
+const auto STARVATION_TIMEOUT = std::chrono::seconds(2);
+const int LOG_RING_SIZE = 1024;
+const int LOG_LINE_SIZE = 256;
+// Ends lines cut at LOG_LINE_SIZE.
+const std::string LOG_TRUNCATED = "...";
+const auto LOG_FLUSH_INTERVAL = std::chrono::milliseconds(20);
 
 namespace util {
 
+namespace detail {
+
+std::atomic<LogLevel> log_level(LogLevel::Info);
+
+}  // namespace detail
+
 namespace {
 
-struct Worker {
-  Worker()
-      : done_(false), thread_([=] {
-          while (!done_) {
-            std::unique_lock<std::mutex> lock(mutex_);
-            nonempty_.wait(lock, [=] { return !tasks_.empty() || done_; });
-            while (!tasks_.empty()) {
-              {
-                auto task = tasks_.back();
-                tasks_.pop_back();
-                lock.unlock();
-                task();
-              }
-              lock.lock();
-            }
-          }
-        }) {}
-
-  ~Worker() {
-    done_ = true;
-    nonempty_.notify_one();
+struct LogLine {
+  std::chrono::system_clock::time_point time_;
+  LogLevel level_;
+  uint32_t length_;
+  char data_[LOG_LINE_SIZE];
+};
+
+struct LogRing {
+  LogLine lines_[LOG_RING_SIZE];
+  std::atomic<uint64_t> head_{0};
+  std::atomic<uint64_t> tail_{0};
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<uint64_t> truncated_{0};
+};
+
+const char* level_name(LogLevel level) {
+  switch (level) {
+    case LogLevel::Debug:
+      return "debug";
+    case LogLevel::Info:
+      return "info";
+    case LogLevel::Warning:
+      return "warning";
+    case LogLevel::Error:
+      return "error";
+    default:
+      return "";
+  }
+}
+
+struct Logger {
+  Logger() : done_(false), thread_([=] { run(); }) {}
+
+  ~Logger() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_ = true;
+    }
+    done_condition_.notify_one();
     thread_.join();
   }
 
-  void add(std::function<void()> task) {
+  std::shared_ptr<LogRing> ring() {
+    thread_local std::shared_ptr<LogRing> ring;
+    if (!ring) {
+      ring = std::make_shared<LogRing>();
+      std::lock_guard<std::mutex> lock(mutex_);
+      rings_.push_back(ring);
+    }
+    return ring;
+  }
+
+  void write(LogLevel level, const std::string& str) {
+    auto r = ring();
+    auto tail = r->tail_.load(std::memory_order_relaxed);
+    if (tail - r->head_.load(std::memory_order_acquire) == LOG_RING_SIZE) {
+      r->dropped_++;
+      return;
+    }
+    auto& line = r->lines_[tail % LOG_RING_SIZE];
+    line.time_ = std::chrono::system_clock::now();
+    line.level_ = level;
+    auto length = str.empty() ? 0 : str.size() - 1;
+    if (length <= LOG_LINE_SIZE) {
+      line.length_ = length;
+      memcpy(line.data_, str.data(), length);
+    } else {
+      r->truncated_++;
+      line.length_ = LOG_LINE_SIZE;
+      auto kept = LOG_LINE_SIZE - LOG_TRUNCATED.size();
+      memcpy(line.data_, str.data(), kept);
+      memcpy(line.data_ + kept, LOG_TRUNCATED.data(), LOG_TRUNCATED.size());
+    }
+    r->tail_.store(tail + 1, std::memory_order_release);
+  }
+
+  void drain() {
+    std::vector<std::shared_ptr<LogRing>> rings;
     {
       std::lock_guard<std::mutex> lock(mutex_);
-      tasks_.push_back(task);
+      rings = rings_;
+    }
+    std::string output;
+    for (const auto& r : rings) {
+      auto head = r->head_.load(std::memory_order_relaxed);
+      auto tail = r->tail_.load(std::memory_order_acquire);
+      for (; head != tail; head++) {
+        const auto& line = r->lines_[head % LOG_RING_SIZE];
+        auto time = std::chrono::system_clock::to_time_t(line.time_);
+        struct tm tm;
+        localtime_r(&time, &tm);
+        char timestamp[32];
+        strftime(timestamp, sizeof(timestamp), "%F %T", &tm);
+        output += std::string("[") + timestamp + "] " +
+                  level_name(line.level_) + " ";
+        output.append(line.data_, line.length_);
+        output += "\n";
+        written_++;
+      }
+      r->head_.store(head, std::memory_order_release);
+    }
+    if (!output.empty()) {
+      std::cerr << output;
+      std::cerr.flush();
+    }
+    // Rings referenced only by rings_ belong to exited threads.
+    rings.clear();
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = rings_.begin(); it != rings_.end();) {
+      if (it->use_count() == 1 && (*it)->head_ == (*it)->tail_) {
+        retired_dropped_ += (*it)->dropped_;
+        retired_truncated_ += (*it)->truncated_;
+        it = rings_.erase(it);
+      } else {
+        it++;
+      }
     }
-    if (!tasks_.empty()) nonempty_.notify_one();
   }
 
-  int task_cnt() {
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!done_) {
+      done_condition_.wait_for(lock, LOG_FLUSH_INTERVAL);
+      lock.unlock();
+      drain();
+      lock.lock();
+    }
+    lock.unlock();
+    drain();
+  }
+
+  LogStats stats() {
+    LogStats result = {written_, 0, 0, sampled_out_};
     std::lock_guard<std::mutex> lock(mutex_);
-    return tasks_.size();
+    result.dropped_ = retired_dropped_;
+    result.truncated_ = retired_truncated_;
+    for (const auto& r : rings_) {
+      result.dropped_ += r->dropped_;
+      result.truncated_ += r->truncated_;
+    }
+    return result;
   }
 
   std::mutex mutex_;
-  std::vector<std::function<void()>> tasks_;
-  std::condition_variable nonempty_;
-  std::atomic_bool done_;
+  std::condition_variable done_condition_;
+  std::vector<std::shared_ptr<LogRing>> rings_;
+  std::atomic<uint64_t> written_{0};
+  std::atomic<uint64_t> sampled_out_{0};
+  std::atomic<int> sample_rate_{1};
+  uint64_t retired_dropped_ = 0;
+  uint64_t retired_truncated_ = 0;
+  bool done_;
   std::thread thread_;
-} worker[WORKER_CNT];
+} logger;
+
+// Runs tasks on a small thread pool. Tenants take turns round robin and each
+// tenant's newest task runs first. Tasks left waiting for longer than
+// STARVATION_TIMEOUT are served ahead of everything else.
+struct Scheduler {
+  Scheduler(int thread_count) : done_(false), size_(), running_(), promoted_() {
+    for (int i = 0; i < thread_count; i++)
+      threads_.emplace_back([=] { run(); });
+  }
+
+  ~Scheduler() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_ = true;
+    }
+    nonempty_.notify_all();
+    for (auto& t : threads_) t.join();
+  }
+
+  void add(const std::string& tenant, std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto& tasks = tenants_[tenant];
+      if (tasks.empty()) active_.push_back(tenant);
+      tasks.push_back({task, std::chrono::steady_clock::now()});
+      size_++;
+    }
+    nonempty_.notify_all();
+  }
+
+  SchedulerStats stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return {size_, running_, promoted_};
+  }
+
+ private:
+  struct Task {
+    std::function<void()> function_;
+    std::chrono::steady_clock::time_point time_;
+  };
+
+  // Picks the tenant to run next, returns false if nothing can run.
+  bool select(std::string* tenant, bool* oldest) {
+    if (size_ == 0) return false;
+    auto starved = std::chrono::steady_clock::now() - STARVATION_TIMEOUT;
+    for (const auto& t : tenants_)
+      if (t.second.front().time_ < starved) {
+        starved = t.second.front().time_;
+        *tenant = t.first;
+        *oldest = true;
+      }
+    if (!*oldest) *tenant = active_.front();
+    return true;
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      std::string tenant;
+      bool oldest = false;
+      nonempty_.wait(lock,
+                     [&] { return done_ || select(&tenant, &oldest); });
+      if (done_) return;
+      auto& tasks = tenants_[tenant];
+      Task task;
+      if (oldest) {
+        promoted_++;
+        task = std::move(tasks.front());
+        tasks.pop_front();
+      } else {
+        task = std::move(tasks.back());
+        tasks.pop_back();
+      }
+      active_.erase(std::find(active_.begin(), active_.end(), tenant));
+      if (tasks.empty())
+        tenants_.erase(tenant);
+      else
+        active_.push_back(tenant);
+      size_--;
+      running_++;
+      lock.unlock();
+      task.function_();
+      task.function_ = nullptr;
+      lock.lock();
+      running_--;
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable nonempty_;
+  bool done_;
+  std::unordered_map<std::string, std::deque<Task>> tenants_;
+  std::deque<std::string> active_;
+  uint64_t size_;
+  uint64_t running_;
+  uint64_t promoted_;
+  std::vector<std::thread> threads_;
+};
+
+std::atomic_int scheduler_thread_count(DEFAULT_WORKER_THREADS);
+
+Scheduler& scheduler() {
+  static Scheduler scheduler(scheduler_thread_count);
+  return scheduler;
+}
 
 }  // namespace
 
-void enqueue(std::function<void()> f) {
-  auto best = &worker[0];
-  for (size_t i = 1; i < WORKER_CNT; i++)
-    if (best->task_cnt() > worker[i].task_cnt()) best = &worker[i];
-  best->add(f);
+namespace detail {
+
+std::ostringstream& log_stream() {
+  thread_local std::ostringstream stream;
+  return stream;
+}
+
+bool log_sample() {
+  thread_local uint64_t counter;
+  if (counter++ % logger.sample_rate_ == 0) return true;
+  logger.sampled_out_++;
+  return false;
+}
+
+void log_write(LogLevel level, const std::string& str) {
+  logger.write(level, str);
+}
+
+}  // namespace detail
+
+void enqueue(const std::string& tenant, std::function<void()> f) {
+  if (auto trace = Trace::current()) {
+    trace->mark("enqueued");
+    f = [trace, f] {
+      Trace::Scope scope(trace);
+      trace->mark("dequeued");
+      f();
+    };
+  }
+  scheduler().add(tenant, std::move(f));
+}
+
+void scheduler_configure(const Json::Value& config) {
+  if (config.isMember("worker_threads"))
+    scheduler_thread_count = std::max(1, config["worker_threads"].asInt());
+}
+
+SchedulerStats scheduler_stats() { return scheduler().stats(); }
+
+void log_configure(const Json::Value& config) {
+  auto level = config["log_level"].asString();
+  if (level == "debug")
+    detail::log_level = LogLevel::Debug;
+  else if (level == "warning")
+    detail::log_level = LogLevel::Warning;
+  else if (level == "error")
+    detail::log_level = LogLevel::Error;
+  else
+    detail::log_level = LogLevel::Info;
+  if (config.isMember("log_sample_rate"))
+    logger.sample_rate_ = std::max(1, config["log_sample_rate"].asInt());
+}
+
+LogStats log_stats() { return logger.stats(); }
+
+ResourceUsage resource_usage() {
+  ResourceUsage result = {};
+#ifdef __linux__
+  std::ifstream statm("/proc/self/statm");
+  uint64_t size = 0, resident = 0;
+  if (statm >> size >> resident)
+    result.rss_ = resident * sysconf(_SC_PAGESIZE);
+  if (auto dir = opendir("/proc/self/fd")) {
+    while (auto e = readdir(dir))
+      if (e->d_name[0] != '.') result.fds_++;
+    closedir(dir);
+    // The descriptor of the directory stream itself.
+    if (result.fds_ > 0) result.fds_--;
+  }
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line))
+    if (line.compare(0, 8, "Threads:") == 0)
+      result.threads_ = std::strtoull(line.c_str() + 8, nullptr, 10);
+#endif
+  return result;
 }
 
 }  // namespace util
@@ -4,17 +4,92 @@
 #include <cloudstorage/ICloudProvider.h>
 #include <cloudstorage/IHttp.h>
 #include <json/json.h>
+#include <atomic>
 #include <condition_variable>
 #include <ctime>
 #include <iomanip>
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <sstream>
 #include <utility>
 
 namespace util {
 
-void enqueue(std::function<void()> f);
+enum class LogLevel { Debug, Info, Warning, Error };
+
+// Request classes, from the most to the least urgent.
+enum class Priority { Interactive, Thumbnail };
+
+struct SchedulerStats {
+  uint64_t queued_;
+  uint64_t running_;
+  uint64_t promoted_;
+};
+
+struct ResourceUsage {
+  uint64_t rss_;
+  uint64_t fds_;
+  uint64_t threads_;
+};
+
+struct LogStats {
+  uint64_t written_;
+  uint64_t dropped_;
+  // Lines cut short, they end with "...".
+  uint64_t truncated_;
+  uint64_t sampled_out_;
+};
+
+namespace detail {
+
+extern std::atomic<LogLevel> log_level;
+
+std::ostringstream& log_stream();
+bool log_sample();
+void log_write(LogLevel, const std::string&);
+
+template <class... Args>
+void log(LogLevel level, Args&&... args) {
+  auto& stream = log_stream();
+  stream.str("");
+  int dummy[] = {0, (stream << args << ' ', 0)...};
+  (void)dummy;
+  log_write(level, stream.str());
+}
+
+}  // namespace detail
+
+// Runs |f| on the worker pool, taking turns with the other tenants' tasks.
+void enqueue(const std::string& tenant, std::function<void()> f);
+
+// Sets the worker thread count, has effect only before the first enqueue.
+void scheduler_configure(const Json::Value& config);
+SchedulerStats scheduler_stats();
+
+void log_configure(const Json::Value& config);
+LogStats log_stats();
+
+// Resident memory in bytes, open file descriptors and threads of this process;
+// zeros where /proc isn't available.
+ResourceUsage resource_usage();
+
+template <class... Args>
+void log(LogLevel level, Args&&... args) {
+  if (level >= detail::log_level)
+    detail::log(level, std::forward<Args>(args)...);
+}
+
+template <class... Args>
+void log(Args&&... args) {
+  log(LogLevel::Info, std::forward<Args>(args)...);
+}
+
+template <class... Args>
+void log_sampled(Args&&... args) {
+  if (LogLevel::Info >= detail::log_level && detail::log_sample())
+    detail::log(LogLevel::Info, std::forward<Args>(args)...);
+}
 
 }  // namespace util
 
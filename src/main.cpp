@@ -7,6 +7,8 @@
 #include <thread>
 
 #include "HttpServer.h"
+#include "Soak.h"
+#include "Supervisor.h"
 #include "Utility.h"
 
 int main(int argc, char** argv) {
@@ -23,5 +25,15 @@ int main(int argc, char** argv) {
     std::cerr << "invalid config\n";
     return 1;
   }
+  if (config.isMember("soak")) return Soak(config).exec();
+  if (auto status = WorkerStatus::attach())
+    return HttpServer(config, status.get()).exec();
+  auto workers = config["workers"].asInt();
+  if (workers > 1) {
+    if (Supervisor::supported())
+      return Supervisor(std::vector<std::string>(argv, argv + argc), workers)
+          .exec();
+    std::cerr << "worker processes not supported, running single process\n";
+  }
   return HttpServer(config).exec();
 }